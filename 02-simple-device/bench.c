@@ -0,0 +1,170 @@
+/* bench.c -- throughput of one writer and one reader on /dev/shofer
+ *
+ * Writer and reader threads are pinned to given CPUs; writer pushes
+ * 'total' bytes in 'chunk' sized writes, reader drains them.
+ * Mode (last argument):
+ *  dev    - writer writes from memory, reader reads into memory
+ *  copy   - writer copies a file to device, reader copies device to
+ *           /dev/null, with read+write (data goes through user space)
+ *  splice - as copy, but with sendfile (file to device) and splice
+ *           (device to pipe to /dev/null); data stays in kernel
+ *
+ * Build: gcc -O2 -pthread bench.c -o bench
+ * Usage: ./bench [total-bytes [chunk [writer-cpu [reader-cpu [mode]]]]]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#define DEVICE	"/dev/shofer"
+
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
+			} while (0)
+
+static size_t total = 64 * 1024 * 1024;
+static size_t chunk = 32;
+static char *mode = "dev";
+static int src = -1; /* file for copy and splice modes */
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		fprintf(stderr, "can't pin to cpu %d\n", cpu);
+}
+
+static void *writer(void *arg)
+{
+	int fd;
+	size_t done = 0, n;
+	ssize_t s;
+	off_t off = 0;
+	char *buf = malloc(chunk);
+
+	pin(*(int *) arg);
+	memset(buf, 'W', chunk);
+
+	fd = open(DEVICE, O_WRONLY);
+	if (fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	while (done < total) {
+		n = chunk < total - done ? chunk : total - done;
+		if (!strcmp(mode, "splice")) {
+			s = sendfile(fd, src, &off, n); /* moves off */
+			if (s == -1)
+				errExit("sendfile");
+			done += s;
+			continue;
+		}
+		if (!strcmp(mode, "copy") && pread(src, buf, n, off) != n)
+			errExit("pread"); /* what device didn't take is read again */
+		s = write(fd, buf, n);
+		if (s == -1) {
+			perror("write");
+			exit(1);
+		}
+		done += s;
+		off += s;
+	}
+	close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	int fd, null, pfd[2];
+	size_t done = 0;
+	ssize_t s;
+	char *buf = malloc(chunk);
+
+	pin(*(int *) arg);
+
+	fd = open(DEVICE, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	null = open("/dev/null", O_WRONLY);
+	if (null == -1 || pipe(pfd) == -1)
+		errExit("open /dev/null or pipe");
+	while (done < total) {
+		if (!strcmp(mode, "splice")) {
+			s = splice(fd, NULL, pfd[1], NULL, chunk, 0);
+			if (s > 0 && splice(pfd[0], NULL, null, NULL, s, 0) != s)
+				errExit("splice to /dev/null");
+		}
+		else {
+			s = read(fd, buf, chunk);
+			if (s > 0 && !strcmp(mode, "copy") &&
+				write(null, buf, s) != s)
+				errExit("write to /dev/null");
+		}
+		if (s == -1) {
+			perror("read");
+			exit(1);
+		}
+		done += s;
+	}
+	close(pfd[0]);
+	close(pfd[1]);
+	close(null);
+	close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int wcpu = 0, rcpu = 1;
+	pthread_t w, r;
+	struct timespec t0, t1;
+	double sec;
+
+	if (argc > 1)
+		total = atol(argv[1]);
+	if (argc > 2)
+		chunk = atol(argv[2]);
+	if (argc > 3)
+		wcpu = atoi(argv[3]);
+	if (argc > 4)
+		rcpu = atoi(argv[4]);
+	if (argc > 5)
+		mode = argv[5];
+
+	if (strcmp(mode, "dev")) {
+		/* source file for writer, in memory so disk isn't measured */
+		src = memfd_create("bench", 0);
+		if (src == -1 || ftruncate(src, total) == -1)
+			errExit("memfd_create");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_create(&r, NULL, reader, &rcpu);
+	pthread_create(&w, NULL, writer, &wcpu);
+	pthread_join(w, NULL);
+	pthread_join(r, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%s: %zu bytes in %zu byte chunks, writer cpu %d, reader cpu %d: "
+		"%.3f s, %.1f MB/s\n", mode, total, chunk, wcpu, rcpu, sec,
+		total / sec / 1e6);
+
+	return 0;
+}
@@ -11,6 +11,8 @@
 
 #pragma once
 
+#ifdef SHOFER_C
+
 #define DRIVER_NAME 	"shofer"
 
 #define AUTHOR		"Leonardo Jelenkovic"
@@ -18,10 +20,34 @@
 
 #define BUFFER_SIZE	64
 
-/* Circular buffer */
+/* Ring types (how a side gets other side's index) */
+#define RING_KFIFO	0	/* load it on every operation */
+#define RING_CACHED	1	/* use cached copy, load when it runs out */
+
+/* Allocators for control page and data (backing) */
+#define BACKING_KMALLOC	0	/* small buffers */
+#define BACKING_VMALLOC	1	/* large buffers, not physically contiguous */
+#define BACKING_PAGES	2	/* physically contiguous (compound) pages */
+
+/*
+ * Circular buffer
+ * Producer side and consumer side fields are on separate cache lines.
+ */
 struct buffer {
-	struct kfifo fifo;
+	struct kfifo fifo;	/* data and mask only, indices are in ring */
+	struct shofer_ring *ring; /* control page, shared with user space */
+	size_t area_size;	/* control page + data, as allocated */
+	int type;		/* RING_KFIFO or RING_CACHED */
 	struct mutex lock;	/* prevent parallel access */
+	struct wait_queue_head wait; /* for poll */
+
+	/* producer side */
+	struct mutex wlock ____cacheline_aligned; /* spsc mode: serialize writers */
+	unsigned int cached_tail; /* last loaded ring->tail */
+
+	/* consumer side */
+	struct mutex rlock ____cacheline_aligned; /* spsc mode: serialize readers */
+	unsigned int cached_head; /* last loaded ring->head */
 };
 
 /* Device driver */
@@ -30,3 +56,28 @@ struct shofer_dev {
 	struct cdev cdev;	/* Char device structure */
 	struct buffer *buffer;	/* Pointer to buffer */
 };
+
+#endif /* SHOFER_C */
+
+/*
+ * Shared ring, available with mmap:
+ * - offset 0: control page (struct shofer_ring)
+ * - offset PAGE_SIZE: data, ring->size bytes (power of 2)
+ * Indices are free running; data for index i is at data[i & (size - 1)].
+ * Producer only moves head, consumer only moves tail (release semantics);
+ * each side is used either through mmap or through read/write, not both.
+ * Fields are on separate cache lines so producer and consumer don't
+ * false-share; a side should read other side's index only when its
+ * cached copy says the ring is empty (full).
+ */
+#define SHOFER_CACHE_LINE	64
+
+struct shofer_ring {
+	unsigned int head __attribute__((aligned(SHOFER_CACHE_LINE)));
+	unsigned int tail __attribute__((aligned(SHOFER_CACHE_LINE)));
+	unsigned int size __attribute__((aligned(SHOFER_CACHE_LINE)));
+};
+
+/* for ioctl */
+#define SHOFER_IOCTL_TYPE	0x8A
+#define SHOFER_IOCTL_KICK	_IO(SHOFER_IOCTL_TYPE, 1) /* wake sleepers in poll */
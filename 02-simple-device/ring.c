@@ -0,0 +1,97 @@
+/* ring.c -- produce or consume through mapped ring, without read/write
+ *
+ * Build: gcc -O2 ring.c -o ring
+ * Usage: ./ring w text	(put text into ring)
+ *	  ./ring r		(wait for data and print it)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "config.h" /* struct shofer_ring, SHOFER_IOCTL_KICK */
+
+#define DEVICE	"/dev/shofer"
+
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
+			} while (0)
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	long page = sysconf(_SC_PAGESIZE);
+	struct shofer_ring *ring;
+	char *data;
+	unsigned int head, tail, size, i, len;
+	struct pollfd pfd;
+
+	if (argc < 2 || (argv[1][0] == 'w' && argc < 3)) {
+		fprintf(stderr, "Usage: %s w text | %s r\n", argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(DEVICE, O_RDWR);
+	if (fd == -1)
+		errExit("open");
+
+	/* map control page first to get data size */
+	ring = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		errExit("mmap");
+	size = ring->size;
+	munmap(ring, page);
+
+	ring = mmap(NULL, page + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		errExit("mmap");
+	data = (char *) ring + page;
+
+	pfd.fd = fd;
+
+	if (argv[1][0] == 'w') {
+		len = strlen(argv[2]);
+		for (i = 0; i < len; ) {
+			head = ring->head; /* only we move head */
+			tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+			if (head - tail == size) { /* full: sleep in poll */
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, -1) == -1)
+					errExit("poll");
+				continue;
+			}
+			for (; i < len && head - tail < size; i++, head++)
+				data[head & (size - 1)] = argv[2][i];
+			__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+			if (ioctl(fd, SHOFER_IOCTL_KICK) == -1) /* wake reader */
+				errExit("ioctl");
+		}
+		printf("put %u bytes\n", len);
+	}
+	else {
+		while (1) {
+			tail = ring->tail; /* only we move tail */
+			head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			if (head == tail) { /* empty: sleep in poll */
+				pfd.events = POLLIN;
+				if (poll(&pfd, 1, -1) == -1)
+					errExit("poll");
+				continue;
+			}
+			for (; tail != head; tail++)
+				putchar(data[tail & (size - 1)]);
+			fflush(stdout);
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+			if (ioctl(fd, SHOFER_IOCTL_KICK) == -1) /* wake writer */
+				errExit("ioctl");
+		}
+	}
+
+	munmap(ring, page + size);
+	close(fd);
+
+	return 0;
+}
@@ -4,6 +4,8 @@
  * Example module which creates a virtual device driver.
  * Circular buffer (kfifo) is used to store received data (with write) and
  * reply with them on read operation.
+ * Buffer can also be mapped (mmap) into process address space: control page
+ * with indices followed by data pages (see struct shofer_ring in config.h).
  *
  * Copyright (C) 2021 Leonardo Jelenkovic
  *
@@ -23,7 +25,17 @@
 #include <linux/cdev.h>
 #include <linux/kfifo.h>
 #include <linux/log2.h>
-
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/fs.h>
+
+#define SHOFER_C
 #include "config.h"
 
 /* Buffer size */
@@ -33,6 +45,25 @@ static int buffer_size = BUFFER_SIZE;
 module_param(buffer_size, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_size, "Buffer size in bytes, must be a power of 2");
 
+/*
+ * Single producer/single consumer mode: kfifo needs no locking when there is
+ * only one reader and one writer, so readers serialize only with readers and
+ * writers only with writers; a reader and a writer can run in parallel
+ */
+static bool spsc = false;
+module_param(spsc, bool, S_IRUGO);
+MODULE_PARM_DESC(spsc, "Separate reader and writer locks (default: one lock)");
+
+/* How sides get each other's index, see RING_* in config.h */
+static int ring_type = RING_KFIFO;
+module_param(ring_type, int, S_IRUGO);
+MODULE_PARM_DESC(ring_type, "0 - load indices on every operation, 1 - cached");
+
+/* Allocator for control page and data, see BACKING_* in config.h */
+static int backing = BACKING_VMALLOC;
+module_param(backing, int, S_IRUGO);
+MODULE_PARM_DESC(backing, "Buffer memory: 0 - kmalloc, 1 - vmalloc, 2 - pages");
+
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
@@ -41,25 +72,51 @@ struct buffer *Buffer = NULL;
 static dev_t Dev_no = 0;
 
 /* prototypes */
-static struct buffer *buffer_create(size_t, int *);
+static struct buffer *buffer_create(size_t, int, int *);
 static void buffer_delete(struct buffer *);
+static void *area_alloc(size_t);
+static void area_free(void *, size_t);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
 static void cleanup(void);
 static void dump_buffer(struct buffer *);
+static int ring_view(struct buffer *, struct kfifo *);
+static int ring_reader_view(struct buffer *, struct kfifo *, size_t);
+static int ring_writer_view(struct buffer *, struct kfifo *, size_t);
+static unsigned int fifo_to_iter(struct kfifo *, struct iov_iter *);
+static unsigned int fifo_from_iter(struct kfifo *, struct iov_iter *);
+static int lock_iocb(struct mutex *, struct kiocb *);
 
 static int shofer_open(struct inode *, struct file *);
 static int shofer_release(struct inode *, struct file *);
-static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t shofer_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_write_iter(struct kiocb *, struct iov_iter *);
+static unsigned int shofer_poll(struct file *, poll_table *);
+static int shofer_mmap(struct file *, struct vm_area_struct *);
+static long shofer_ioctl(struct file *, unsigned int, unsigned long);
+
+/*
+ * splice(2), sendfile(2): data goes between pipe (or file) and buffer
+ * through read_iter/write_iter, without a copy in user space
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define shofer_splice_read	copy_splice_read
+#else
+#define shofer_splice_read	generic_file_splice_read
+#endif
 
 static struct file_operations shofer_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open,
 	.release =  shofer_release,
-	.read =     shofer_read,
-	.write =    shofer_write
+	.read_iter =  shofer_read_iter,
+	.write_iter = shofer_write_iter,
+	.splice_read = shofer_splice_read,
+	.splice_write = iter_file_splice_write,
+	.poll =     shofer_poll,
+	.mmap =     shofer_mmap,
+	.unlocked_ioctl = shofer_ioctl
 };
 
 /* init module */
@@ -84,7 +141,7 @@ static int __init shofer_module_init(void)
 	/* buffer size must be a power of 2 */
 	if (!is_power_of_2(buffer_size))
 		buffer_size = roundup_pow_of_two(buffer_size);
-	buffer = buffer_create(buffer_size, &retval);
+	buffer = buffer_create(buffer_size, ring_type, &retval);
 	if (!buffer)
 		goto no_driver;
 	Buffer = buffer;
@@ -128,22 +185,56 @@ static void __exit shofer_module_exit(void)
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
-static struct buffer *buffer_create(size_t size, int *retval)
+/*
+ * Create and initialize a single buffer
+ * Control page and data are allocated together (zeroed, page aligned) so
+ * they can be mapped into user space.
+ */
+static struct buffer *buffer_create(size_t size, int type, int *retval)
 {
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
+	void *area;
+	struct buffer *buffer;
+
+	if (type != RING_KFIFO && type != RING_CACHED) {
+		*retval = -EINVAL;
+		printk(KERN_NOTICE "shofer:unknown ring type %d\n", type);
+		return NULL;
+	}
+	if (backing < BACKING_KMALLOC || backing > BACKING_PAGES) {
+		*retval = -EINVAL;
+		printk(KERN_NOTICE "shofer:unknown backing %d\n", backing);
+		return NULL;
+	}
+
+	buffer = kmalloc(sizeof(struct buffer), GFP_KERNEL);
 	if (!buffer) {
 		*retval = -ENOMEM;
 		printk(KERN_NOTICE "shofer:kmalloc failed\n");
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	area = area_alloc(PAGE_SIZE + size);
+	if (!area) {
+		*retval = -ENOMEM;
+		kfree(buffer);
+		printk(KERN_NOTICE "shofer:area_alloc failed\n");
+		return NULL;
+	}
+	*retval = kfifo_init(&buffer->fifo, area + PAGE_SIZE, size);
 	if (*retval) {
+		area_free(area, PAGE_SIZE + size);
 		kfree(buffer);
 		printk(KERN_NOTICE "shofer:kfifo_init failed\n");
 		return NULL;
 	}
+	buffer->ring = area;
+	buffer->area_size = PAGE_SIZE + size;
+	buffer->ring->size = size;
+	buffer->type = type;
+	buffer->cached_head = buffer->cached_tail = 0;
+	init_waitqueue_head(&buffer->wait);
 	mutex_init(&buffer->lock);
+	mutex_init(&buffer->rlock);
+	mutex_init(&buffer->wlock);
 	*retval = 0;
 
 	return buffer;
@@ -151,9 +242,111 @@ static struct buffer *buffer_create(size_t size, int *retval)
 
 static void buffer_delete(struct buffer *buffer)
 {
+	area_free(buffer->ring, buffer->area_size);
 	kfree(buffer);
 }
 
+/*
+ * Allocate zeroed, page aligned memory with allocator chosen by 'backing'
+ * Pages are physically contiguous; of huge page order they are mapped
+ * with huge pages in kernel linear mapping (fewer TLB misses when
+ * streaming). If they can't be found, vmalloc is used instead.
+ * kmalloc of a power of 2 size is aligned to that size.
+ */
+static void *area_alloc(size_t size)
+{
+	struct page *page;
+
+	switch (backing) {
+	case BACKING_VMALLOC:
+		return vmalloc_user(size);
+	case BACKING_PAGES:
+		page = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_COMP |
+			__GFP_NOWARN, get_order(size));
+		if (page)
+			return page_address(page);
+		printk(KERN_NOTICE "shofer:alloc_pages failed, using vmalloc\n");
+		return vmalloc_user(size);
+	default:
+		return kzalloc(PAGE_SIZE << get_order(size), GFP_KERNEL);
+	}
+}
+
+/* Free memory from area_alloc */
+static void area_free(void *area, size_t size)
+{
+	if (is_vmalloc_addr(area))
+		vfree(area);
+	else if (backing == BACKING_PAGES)
+		free_pages((unsigned long) area, get_order(size));
+	else
+		kfree(area);
+}
+
+/*
+ * Get a kfifo with current indices from control page
+ * Each side works on its own copy and publishes only its own index, so a
+ * reader (or user space consumer) and a writer don't overwrite each other.
+ */
+static int ring_view(struct buffer *buffer, struct kfifo *view)
+{
+	*view = buffer->fifo;
+	view->kfifo.in = smp_load_acquire(&buffer->ring->head);
+	view->kfifo.out = smp_load_acquire(&buffer->ring->tail);
+
+	/* indices can be changed by user space; don't trust them */
+	if (view->kfifo.in - view->kfifo.out > kfifo_size(view)) {
+		printk(KERN_NOTICE "shofer:ring indices corrupted\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Views for reader and writer: own index from control page, other side's
+ * index from own cache line; other side's line is touched only when the
+ * cached value doesn't give count bytes (of data or space), or always
+ * with RING_KFIFO
+ */
+static int ring_reader_view(struct buffer *buffer, struct kfifo *view,
+	size_t count)
+{
+	*view = buffer->fifo;
+	view->kfifo.out = READ_ONCE(buffer->ring->tail);
+	view->kfifo.in = buffer->cached_head;
+	if (buffer->type == RING_KFIFO || view->kfifo.in - view->kfifo.out >
+		kfifo_size(view) || kfifo_len(view) < count)
+		view->kfifo.in = buffer->cached_head =
+			smp_load_acquire(&buffer->ring->head);
+
+	if (view->kfifo.in - view->kfifo.out > kfifo_size(view)) {
+		printk(KERN_NOTICE "shofer:ring indices corrupted\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int ring_writer_view(struct buffer *buffer, struct kfifo *view,
+	size_t count)
+{
+	*view = buffer->fifo;
+	view->kfifo.in = READ_ONCE(buffer->ring->head);
+	view->kfifo.out = buffer->cached_tail;
+	if (buffer->type == RING_KFIFO || view->kfifo.in - view->kfifo.out >
+		kfifo_size(view) || kfifo_avail(view) < count)
+		view->kfifo.out = buffer->cached_tail =
+			smp_load_acquire(&buffer->ring->tail);
+
+	if (view->kfifo.in - view->kfifo.out > kfifo_size(view)) {
+		printk(KERN_NOTICE "shofer:ring indices corrupted\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
 /* Create and initialize a single shofer_dev */
 static struct shofer_dev *shofer_create(dev_t dev_no,
 	struct file_operations *fops, struct buffer *buffer, int *retval)
@@ -194,6 +387,7 @@ static int shofer_open(struct inode *inode, struct file *filp)
 
 	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
 	filp->private_data = shofer; /* for other methods */
+	filp->f_mode |= FMODE_NOWAIT; /* RWF_NOWAIT: see lock_iocb */
 
 	return 0;
 }
@@ -204,70 +398,221 @@ static int shofer_release(struct inode *inode, struct file *filp)
 	return 0; /* nothing to do; could not set this function in fops */
 }
 
-/* Read count bytes from buffer to user space ubuf */
-static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
-	loff_t *f_pos /* ignoring f_pos */)
+/*
+ * Read from buffer to user space (read, readv, preadv2; ignoring f_pos)
+ * All of iov_iter is filled under one lock, as much as there is data.
+ */
+static ssize_t shofer_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
+	struct kfifo view, *fifo = &view;
+	struct mutex *lock = spsc ? &buffer->rlock : &buffer->lock;
+	size_t count = iov_iter_count(to);
 	unsigned int copied;
 
-	if (mutex_lock_interruptible(&buffer->lock))
-		return -ERESTARTSYS;
+	retval = lock_iocb(lock, iocb);
+	if (retval)
+		return retval;
 
 	dump_buffer(buffer);
 
-	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
+	retval = ring_reader_view(buffer, fifo, count);
 	if (retval)
-		printk(KERN_NOTICE "shofer:kfifo_to_user failed\n");
-	else
+		goto out;
+
+	copied = fifo_to_iter(fifo, to);
+	if (!copied && kfifo_len(fifo) && count) {
+		printk(KERN_NOTICE "shofer:copy_to_iter failed\n");
+		retval = -EFAULT;
+	}
+	else {
 		retval = copied;
+	}
+
+	/* publish consumed space */
+	smp_store_release(&buffer->ring->tail, fifo->kfifo.out);
 
 	dump_buffer(buffer);
+out:
+	mutex_unlock(lock);
 
-	mutex_unlock(&buffer->lock);
+	if (retval > 0)
+		wake_up_interruptible(&buffer->wait); /* for poll */
 
 	return retval;
 }
 
-/* Write count bytes from user space ubuf to buffer */
-static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
-	size_t count, loff_t *f_pos /* ignoring f_pos */)
+/*
+ * Write from user space to buffer (write, writev, pwritev2; ignoring
+ * f_pos); all of iov_iter that fits is taken under one lock
+ */
+static ssize_t shofer_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
+	struct kfifo view, *fifo = &view;
+	struct mutex *lock = spsc ? &buffer->wlock : &buffer->lock;
+	size_t count = iov_iter_count(from);
 	unsigned int copied;
 
-	if (mutex_lock_interruptible(&buffer->lock))
-		return -ERESTARTSYS;
+	retval = lock_iocb(lock, iocb);
+	if (retval)
+		return retval;
 
 	dump_buffer(buffer);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
+	retval = ring_writer_view(buffer, fifo, count);
 	if (retval)
-		printk(KERN_NOTICE "shofer:kfifo_from_user failed\n");
-	else
+		goto out;
+
+	copied = fifo_from_iter(fifo, from);
+	if (!copied && kfifo_avail(fifo) && count) {
+		printk(KERN_NOTICE "shofer:copy_from_iter failed\n");
+		retval = -EFAULT;
+	}
+	else {
 		retval = copied;
+	}
+
+	/* publish written data */
+	smp_store_release(&buffer->ring->head, fifo->kfifo.in);
 
 	dump_buffer(buffer);
+out:
+	mutex_unlock(lock);
 
-	mutex_unlock(&buffer->lock);
+	if (retval > 0)
+		wake_up_interruptible(&buffer->wait); /* for poll */
 
 	return retval;
 }
 
+/*
+ * Lock for read/write; with IOCB_NOWAIT (RWF_NOWAIT in preadv2/pwritev2)
+ * don't wait for it, caller gets EAGAIN instead
+ */
+static int lock_iocb(struct mutex *lock, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	if (mutex_lock_interruptible(lock))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+/*
+ * Like kfifo_to_user and kfifo_from_user, but with iov_iter: data in
+ * kfifo is in (at most) two parts, each is copied with one call which
+ * goes through all iovecs. Returns number of bytes copied.
+ */
+static unsigned int fifo_to_iter(struct kfifo *fifo, struct iov_iter *to)
+{
+	unsigned int size = kfifo_size(fifo);
+	unsigned int off = fifo->kfifo.out & (size - 1);
+	unsigned int len = min_t(size_t, kfifo_len(fifo), iov_iter_count(to));
+	unsigned int l = min(len, size - off);
+	unsigned int copied;
+
+	copied = copy_to_iter(fifo->kfifo.data + off, l, to);
+	if (copied == l)
+		copied += copy_to_iter(fifo->kfifo.data, len - l, to);
+	fifo->kfifo.out += copied;
+
+	return copied;
+}
+
+static unsigned int fifo_from_iter(struct kfifo *fifo, struct iov_iter *from)
+{
+	unsigned int size = kfifo_size(fifo);
+	unsigned int off = fifo->kfifo.in & (size - 1);
+	unsigned int len = min_t(size_t, kfifo_avail(fifo),
+		iov_iter_count(from));
+	unsigned int l = min(len, size - off);
+	unsigned int copied;
+
+	copied = copy_from_iter(fifo->kfifo.data + off, l, from);
+	if (copied == l)
+		copied += copy_from_iter(fifo->kfifo.data, len - l, from);
+	fifo->kfifo.in += copied;
+
+	return copied;
+}
+
+static unsigned int shofer_poll(struct file *filp, poll_table *wait)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *buffer = shofer->buffer;
+	struct kfifo view;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &buffer->wait, wait);
+
+	if (ring_view(buffer, &view))
+		return POLLERR;
+
+	if (kfifo_len(&view))
+		mask |= POLLIN | POLLRDNORM; /* readable */
+	if (kfifo_avail(&view))
+		mask |= POLLOUT | POLLWRNORM; /* writable */
+
+	return mask;
+}
+
+/* Map control page and data: offset 0 is control page, data follows */
+static int shofer_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *buffer = shofer->buffer;
+	unsigned long pages = vma_pages(vma);
+	unsigned long pfn;
+
+	if (is_vmalloc_addr(buffer->ring))
+		return remap_vmalloc_range(vma, buffer->ring, vma->vm_pgoff);
+
+	/* physically contiguous (kmalloc or pages) */
+	if (vma->vm_pgoff + pages > PAGE_ALIGN(buffer->area_size) >> PAGE_SHIFT)
+		return -EINVAL;
+	pfn = (virt_to_phys(buffer->ring) >> PAGE_SHIFT) + vma->vm_pgoff;
+
+	return remap_pfn_range(vma, vma->vm_start, pfn, pages << PAGE_SHIFT,
+		vma->vm_page_prot);
+}
+
+/* Doorbell: user space moved head or tail, wake up those in poll */
+static long shofer_ioctl(struct file *filp, unsigned int request,
+	unsigned long arg)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *buffer = shofer->buffer;
+
+	if (request != SHOFER_IOCTL_KICK)
+		return -ENOTTY;
+
+	wake_up_interruptible(&buffer->wait);
+
+	return 0;
+}
+
 static void dump_buffer(struct buffer *b)
 {
 	char buf[BUFFER_SIZE];
 	size_t copied;
+	struct kfifo view;
+
+	/* other side may move its index meanwhile; also don't serialize
+	 * reader and writer on console output */
+	if (spsc)
+		return;
+
+	if (ring_view(b, &view))
+		return;
 
 	memset(buf, 0, BUFFER_SIZE);
-	copied = kfifo_out_peek(&b->fifo, buf, BUFFER_SIZE);
+	copied = kfifo_out_peek(&view, buf, BUFFER_SIZE);
 
 	printk(KERN_NOTICE "shofer:buffer:size=%u:contains=%u:buf=%s\n",
-		kfifo_size(&b->fifo), kfifo_len(&b->fifo), buf);
+		kfifo_size(&view), kfifo_len(&view), buf);
 }
@@ -20,6 +20,11 @@
 #define BUFFER_NUM	6
 #define DRIVER_NUM	6
 
+/* Allocators for buffer data (backing) */
+#define BACKING_KMALLOC	0	/* small buffers */
+#define BACKING_VMALLOC	1	/* large buffers, not physically contiguous */
+#define BACKING_PAGES	2	/* physically contiguous (compound) pages */
+
 /* Circular buffer */
 struct buffer {
 	struct kfifo fifo;
@@ -22,6 +22,12 @@
 #include <linux/wait.h>
 #include <linux/kfifo.h>
 #include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/fs.h>
 
 #include "config.h"
 
@@ -37,6 +43,11 @@ MODULE_PARM_DESC(buffer_num, "Number of buffers to create");
 module_param(driver_num, int, S_IRUGO);
 MODULE_PARM_DESC(driver_num, "Number of devices to create");
 
+/* Allocator for buffer data, see BACKING_* in config.h */
+static int backing = BACKING_KMALLOC;
+module_param(backing, int, S_IRUGO);
+MODULE_PARM_DESC(backing, "Buffer memory: 0 - kmalloc, 1 - vmalloc, 2 - pages");
+
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
@@ -48,22 +59,39 @@ static dev_t Dev_no = 0;
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
 static void buffer_delete(struct buffer *);
+static void *data_alloc(size_t);
+static void data_free(void *, size_t);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
 static void cleanup(void);
 static void dump_buffer(char *, struct shofer_dev *, struct buffer *);
 static void simulate_delay(long delay_ms);
+static unsigned int fifo_to_iter(struct kfifo *, struct iov_iter *);
+static unsigned int fifo_from_iter(struct kfifo *, struct iov_iter *);
+static int lock_iocb(struct mutex *, struct kiocb *);
 
 static int shofer_open(struct inode *, struct file *);
-static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t shofer_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_write_iter(struct kiocb *, struct iov_iter *);
+
+/*
+ * splice(2), sendfile(2): data goes between pipe (or file) and buffer
+ * through read_iter/write_iter, without a copy in user space
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define shofer_splice_read	copy_splice_read
+#else
+#define shofer_splice_read	generic_file_splice_read
+#endif
 
 static struct file_operations shofer_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open,
-	.read =     shofer_read,
-	.write =    shofer_write
+	.read_iter =  shofer_read_iter,
+	.write_iter = shofer_write_iter,
+	.splice_read = shofer_splice_read,
+	.splice_write = iter_file_splice_write
 };
 
 /* init module */
@@ -76,6 +104,11 @@ static int __init shofer_module_init(void)
 
 	klog(KERN_NOTICE, "Module started initialization");
 
+	if (backing < BACKING_KMALLOC || backing > BACKING_PAGES) {
+		klog(KERN_WARNING, "Unknown backing %d", backing);
+		return -EINVAL;
+	}
+
 	/* get device number(s) */
 	retval = alloc_chrdev_region(&dev_no, 0, driver_num, DRIVER_NAME);
 	if (retval < 0) {
@@ -156,13 +189,31 @@ module_exit(shofer_module_exit);
 static struct buffer *buffer_create(size_t size, int *retval)
 {
 	static int buffer_id = 0;
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
+	void *data;
+	struct buffer *buffer;
+
+	if (size < 2) {
+		*retval = -EINVAL;
+		klog(KERN_WARNING, "Buffer size %zu too small", size);
+		return NULL;
+	}
+	size = rounddown_pow_of_two(size); /* kfifo would use only that */
+
+	buffer = kmalloc(sizeof(struct buffer), GFP_KERNEL);
 	if (!buffer) {
 		*retval = -ENOMEM;
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	data = data_alloc(size);
+	if (!data) {
+		*retval = -ENOMEM;
+		kfree(buffer);
+		klog(KERN_WARNING, "data_alloc(%zu) failed", size);
+		return NULL;
+	}
+	*retval = kfifo_init(&buffer->fifo, data, size);
 	if (*retval) {
+		data_free(data, size);
 		kfree(buffer);
 		klog(KERN_WARNING, "kfifo_init failed");
 		return NULL;
@@ -176,9 +227,48 @@ static struct buffer *buffer_create(size_t size, int *retval)
 
 static void buffer_delete(struct buffer *buffer)
 {
+	data_free(buffer->fifo.kfifo.data, kfifo_size(&buffer->fifo));
 	kfree(buffer);
 }
 
+/*
+ * Allocate memory for buffer data with allocator chosen by 'backing'
+ * Pages are physically contiguous; of huge page order they are mapped
+ * with huge pages in kernel linear mapping (fewer TLB misses when
+ * streaming). If they can't be found, vmalloc is used instead.
+ */
+static void *data_alloc(size_t size)
+{
+	struct page *page;
+
+	switch (backing) {
+	case BACKING_VMALLOC:
+		return vmalloc(size);
+	case BACKING_PAGES:
+		page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN,
+			get_order(size));
+		if (page)
+			return page_address(page);
+		klog(KERN_NOTICE, "alloc_pages failed, using vmalloc");
+		return vmalloc(size);
+	default:
+		return kmalloc(size, GFP_KERNEL);
+	}
+}
+
+/* Free memory from data_alloc */
+static void data_free(void *data, size_t size)
+{
+	if (!data)
+		return;
+	if (is_vmalloc_addr(data))
+		vfree(data);
+	else if (backing == BACKING_PAGES)
+		free_pages((unsigned long) data, get_order(size));
+	else
+		kfree(data);
+}
+
 /* Create and initialize a single shofer_dev */
 static struct shofer_dev *shofer_create(dev_t dev_no,
 	struct file_operations *fops, struct buffer *buffer, int *retval)
@@ -219,31 +309,37 @@ static int shofer_open(struct inode *inode, struct file *filp)
 
 	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
 	filp->private_data = shofer;
+	filp->f_mode |= FMODE_NOWAIT; /* RWF_NOWAIT: see lock_iocb */
 
 	return 0;
 }
 
-static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
-	loff_t *f_pos)
+/* read, readv, preadv2: whole iov_iter is filled under one lock */
+static ssize_t shofer_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
 	struct kfifo *fifo = &buffer->fifo;
 	unsigned int copied;
 
-	if (mutex_lock_interruptible(&buffer->lock))
-		return -ERESTARTSYS;
+	retval = lock_iocb(&buffer->lock, iocb);
+	if (retval)
+		return retval;
 
 	dump_buffer("read-start", shofer, buffer);
 
-	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
-		klog(KERN_WARNING, "shofer:kfifo_to_user failed");
-	else
+	copied = fifo_to_iter(fifo, to);
+	if (!copied && !kfifo_is_empty(fifo) && iov_iter_count(to)) {
+		klog(KERN_WARNING, "shofer:copy_to_iter failed");
+		retval = -EFAULT;
+	}
+	else {
 		retval = copied;
+	}
 
-	simulate_delay(1000);
+	if (!(iocb->ki_flags & IOCB_NOWAIT))
+		simulate_delay(1000);
 
 	dump_buffer("read-end", shofer, buffer);
 
@@ -252,27 +348,32 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	return retval;
 }
 
-static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
-	size_t count, loff_t *f_pos)
+/* write, writev, pwritev2: all of iov_iter that fits, under one lock */
+static ssize_t shofer_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
 	struct kfifo *fifo = &buffer->fifo;
 	unsigned int copied;
 
-	if (mutex_lock_interruptible(&buffer->lock))
-		return -ERESTARTSYS;
+	retval = lock_iocb(&buffer->lock, iocb);
+	if (retval)
+		return retval;
 
 	dump_buffer("write-start", shofer, buffer);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
-		klog(KERN_WARNING, "shofer:kfifo_from_user failed");
-	else
+	copied = fifo_from_iter(fifo, from);
+	if (!copied && !kfifo_is_full(fifo) && iov_iter_count(from)) {
+		klog(KERN_WARNING, "shofer:copy_from_iter failed");
+		retval = -EFAULT;
+	}
+	else {
 		retval = copied;
+	}
 
-	simulate_delay(1000);
+	if (!(iocb->ki_flags & IOCB_NOWAIT))
+		simulate_delay(1000);
 
 	dump_buffer("write-end", shofer, buffer);
 
@@ -281,6 +382,57 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	return retval;
 }
 
+/*
+ * Lock for read/write; with IOCB_NOWAIT (RWF_NOWAIT in preadv2/pwritev2)
+ * don't wait for it, caller gets EAGAIN instead (and there is no delay)
+ */
+static int lock_iocb(struct mutex *lock, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	if (mutex_lock_interruptible(lock))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+/*
+ * Like kfifo_to_user and kfifo_from_user, but with iov_iter: data in
+ * kfifo is in (at most) two parts, each is copied with one call which
+ * goes through all iovecs. Returns number of bytes copied.
+ */
+static unsigned int fifo_to_iter(struct kfifo *fifo, struct iov_iter *to)
+{
+	unsigned int size = kfifo_size(fifo);
+	unsigned int off = fifo->kfifo.out & (size - 1);
+	unsigned int len = min_t(size_t, kfifo_len(fifo), iov_iter_count(to));
+	unsigned int l = min(len, size - off);
+	unsigned int copied;
+
+	copied = copy_to_iter(fifo->kfifo.data + off, l, to);
+	if (copied == l)
+		copied += copy_to_iter(fifo->kfifo.data, len - l, to);
+	fifo->kfifo.out += copied;
+
+	return copied;
+}
+
+static unsigned int fifo_from_iter(struct kfifo *fifo, struct iov_iter *from)
+{
+	unsigned int size = kfifo_size(fifo);
+	unsigned int off = fifo->kfifo.in & (size - 1);
+	unsigned int len = min_t(size_t, kfifo_avail(fifo),
+		iov_iter_count(from));
+	unsigned int l = min(len, size - off);
+	unsigned int copied;
+
+	copied = copy_from_iter(fifo->kfifo.data + off, l, from);
+	if (copied == l)
+		copied += copy_from_iter(fifo->kfifo.data, len - l, from);
+	fifo->kfifo.in += copied;
+
+	return copied;
+}
+
 static void dump_buffer(char *prefix, struct shofer_dev *shofer, struct buffer *b)
 {
 	char buf[BUFFER_SIZE];
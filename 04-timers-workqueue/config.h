@@ -20,15 +20,51 @@
 #define BUFFER_NUM	6
 #define DRIVER_NUM	6
 
+/* Allocators for buffer data (backing) */
+#define BACKING_KMALLOC	0	/* small buffers */
+#define BACKING_VMALLOC	1	/* large buffers, not physically contiguous */
+#define BACKING_PAGES	2	/* physically contiguous (compound) pages */
+
 #define TIMER_PERIOD	500 /* each 500 ms */
 
+/* What timer does when buffer is full (timer_policy) */
+#define POLICY_DROP	 0	/* drop new byte */
+#define POLICY_OVERWRITE 1	/* drop oldest byte to make room */
+
+#define CPU_RECORDS	64	/* records in each per-CPU sub-buffer */
+
+/* Record header in per-CPU sub-buffer; record data is in data fifo */
+struct cpu_rec {
+	u64 ts;			/* when appended, for merging */
+	unsigned int len;	/* record data length */
+};
+
+/* Per-CPU part of buffer (percpu mode) */
+struct cpu_buffer {
+	spinlock_t key;		/* local producers and merging reader */
+	DECLARE_KFIFO_PTR(recs, struct cpu_rec);
+	struct kfifo data;
+	unsigned int head_left;	/* unread part of partially read record */
+	u64 head_ts;		/* and its timestamp */
+};
+
 /* Circular buffer */
 struct buffer {
-	struct kfifo fifo;
+	struct kfifo fifo;	/* not allocated in percpu mode */
 	//struct mutex lock;	/* can't use them in timers; spinlocks instead */
 	spinlock_t key;		/* for locking with timers, tasklets, ... */
+				/* (main fifo only, not sub-buffers) */
 	struct list_head list;
 	int id;			/* id to differentiate buffers in prints */
+
+	struct cpu_buffer __percpu *cpu; /* percpu mode: used instead of fifo,
+					    RCU protected for timer */
+	struct mutex merge;	/* percpu mode: one merging reader at a time */
+
+	unsigned int size;	/* data size, when allocated */
+	int node;		/* NUMA node of data (main fifo) */
+	int users;		/* open files on its devices */
+	int allocated;		/* data allocated (first open) */
 };
 
 /* Device driver */
@@ -41,7 +77,8 @@ struct shofer_dev {
 	struct mutex lock;	/* prevent parallel access */
 
 	struct workqueue_struct *rwq;	/* reader workqueue, one per shofer */
-	struct workqueue_struct *wwq;	/* writter workqueue, one per shofer */
+	struct workqueue_struct *wwq;	/* writter workqueue, one per shofer
+					   (per-CPU workers in percpu mode) */
 
 	/* for tasks waiting for work in workqueue to be done */
 	struct wait_queue_head wqueue;
@@ -53,11 +90,18 @@ struct wq_data {
 	char *buf;
 	size_t len;
 	unsigned int copied;
+	int done; /* operation completed (copied can be 0) */
 	int op; /* 0 - read, 1- write */
 	union {
 		struct wait_queue_head *queue;
 		struct completion *completion;
 	} wakeup;
+
+	/* asynchronous request (AIO, io_uring): nobody waits for it */
+	struct kiocb *iocb;	/* completed by work; NULL if synchronous */
+	struct page **pages;	/* read: reader's pages data goes to */
+	size_t start;		/* offset of data in first page */
+	int npages;
 };
 
 
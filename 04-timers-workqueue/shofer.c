@@ -29,6 +29,19 @@
 #include <linux/kfifo.h>
 #include <linux/log2.h>
 #include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/uio.h>
+#include <linux/highmem.h>
+#include <linux/version.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 
 #include "config.h"
 
@@ -44,10 +57,55 @@ MODULE_PARM_DESC(buffer_num, "Number of buffers to create");
 module_param(driver_num, int, S_IRUGO);
 MODULE_PARM_DESC(driver_num, "Number of devices to create");
 
+/*
+ * Per-CPU mode: producers (writer work, timer) append records to their
+ * CPU's sub-buffer, readers merge sub-buffers by record timestamp.
+ * Writer work is queued on writer's CPU (per-CPU workqueue), so it puts
+ * data in sub-buffer of that CPU; buffer->key isn't used, only locks of
+ * sub-buffers. Sub-buffers exist for all possible CPUs and reader scans
+ * all of them, so data left on a CPU that goes offline is still read.
+ */
+static bool percpu = false;
+module_param(percpu, bool, S_IRUGO);
+MODULE_PARM_DESC(percpu, "Per-CPU sub-buffers merged on read");
+
+/* Allocator for buffer data, see BACKING_* in config.h */
+static int backing = BACKING_KMALLOC;
+module_param(backing, int, S_IRUGO);
+MODULE_PARM_DESC(backing, "Buffer memory: 0 - kmalloc, 1 - vmalloc, 2 - pages");
+
+/*
+ * Timer never waits for room; it either drops its byte or the oldest one
+ * (per-CPU sub-buffers only drop: skipping bytes would break records).
+ * Count of lost bytes is exported as read-only parameter timer_lost.
+ */
+static int timer_policy = POLICY_DROP;
+module_param(timer_policy, int, S_IRUGO);
+MODULE_PARM_DESC(timer_policy, "Buffer full: 0 - drop new, 1 - overwrite oldest");
+static unsigned long timer_lost;
+module_param(timer_lost, ulong, S_IRUGO);
+MODULE_PARM_DESC(timer_lost, "Bytes lost by timer (read only)");
+
+/*
+ * NUMA node for buffers and devices; with -1 structures are on module
+ * loader's node and buffer data is put on node of its first opener (so
+ * it moves with its users: data of an empty buffer is freed on last
+ * close and allocated again on next open). Per-CPU sub-buffers are
+ * always on node of their CPU.
+ */
+static int node = NUMA_NO_NODE;
+module_param(node, int, S_IRUGO);
+MODULE_PARM_DESC(node, "NUMA node for buffers (-1: node of first opener)");
+
+/* Buffer accesses (by node of CPU doing them) to local and remote data */
+static atomic_long_t local_access[MAX_NUMNODES];
+static atomic_long_t remote_access[MAX_NUMNODES];
+
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
 static LIST_HEAD(buffers_list);
+static DEFINE_MUTEX(buffers_lock); /* buffer users and allocation */
 static LIST_HEAD(shofers_list); /* A list of devices */
 
 static dev_t Dev_no = 0;
@@ -57,24 +115,52 @@ static struct timer_list timer;
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
 static void buffer_delete(struct buffer *);
+static int buffer_alloc(struct buffer *);
+static void buffer_free(struct buffer *);
+static void *data_alloc(size_t, int);
+static void cpu_buffers_free(struct cpu_buffer __percpu *);
+static void count_access(struct buffer *);
+static void dump_access(void);
+static void data_free(void *, size_t);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
 static void cleanup(void);
 static void dump_buffer(char *, struct shofer_dev *, struct buffer *);
+static void buffer_lock(struct buffer *);
+static void buffer_unlock(struct buffer *);
 //static void simulate_delay(long delay_ms);
 static void timer_function(struct timer_list *t);
 static void workqueue_operations(struct work_struct *work);
+static unsigned int buffer_len(struct buffer *);
+static unsigned int cpu_buffer_put(struct cpu_buffer __percpu *, char *,
+	unsigned int);
+static unsigned int cpu_buffer_get(struct buffer *, char *, unsigned int);
+
+static int queue_wq_data(struct shofer_dev *, struct workqueue_struct *,
+	struct wq_data *, struct kiocb *, int);
+static ssize_t wq_get_pages(struct wq_data *, struct iov_iter *, size_t);
+static void wq_put_pages(struct wq_data *, bool);
+static void wq_complete(struct wq_data *);
 
 static int shofer_open(struct inode *, struct file *);
-static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static int shofer_release(struct inode *, struct file *);
+static ssize_t shofer_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_write_iter(struct kiocb *, struct iov_iter *);
+
+/* kiocb completion got one argument less in 5.16 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define iocb_complete(iocb, ret)	(iocb)->ki_complete(iocb, ret)
+#else
+#define iocb_complete(iocb, ret)	(iocb)->ki_complete(iocb, ret, 0)
+#endif
 
 static struct file_operations shofer_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open,
-	.read =     shofer_read,
-	.write =    shofer_write
+	.release =  shofer_release,
+	.read_iter =  shofer_read_iter,
+	.write_iter = shofer_write_iter
 };
 
 /* init module */
@@ -87,6 +173,16 @@ static int __init shofer_module_init(void)
 
 	klog(KERN_NOTICE, "Module started initialization");
 
+	if (backing < BACKING_KMALLOC || backing > BACKING_PAGES) {
+		klog(KERN_WARNING, "Unknown backing %d", backing);
+		return -EINVAL;
+	}
+	if (node != NUMA_NO_NODE &&
+		(node < 0 || node >= nr_node_ids || !node_online(node))) {
+		klog(KERN_WARNING, "Node %d is not online", node);
+		return -EINVAL;
+	}
+
 	/* get device number(s) */
 	retval = alloc_chrdev_region(&dev_no, 0, driver_num, DRIVER_NAME);
 	if (retval < 0) {
@@ -163,29 +259,41 @@ static void __exit shofer_module_exit(void)
 {
 	klog(KERN_NOTICE, "Module started exit operation");
 	cleanup();
+	klog(KERN_NOTICE, "Timer lost %lu bytes", timer_lost);
+	dump_access();
 	klog(KERN_NOTICE, "Module finished exit operation");
 }
 
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
+/*
+ * Create and initialize a single buffer
+ * Memory for data is allocated when buffer is first used (buffer_alloc).
+ */
 static struct buffer *buffer_create(size_t size, int *retval)
 {
 	static int buffer_id = 0;
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
-	if (!buffer) {
-		*retval = -ENOMEM;
+	struct buffer *buffer;
+
+	if (size < 2) {
+		*retval = -EINVAL;
+		klog(KERN_WARNING, "Buffer size %zu too small", size);
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
-	if (*retval) {
-		kfree(buffer);
-		klog(KERN_WARNING, "kfifo_init failed");
+
+	buffer = kzalloc_node(sizeof(struct buffer), GFP_KERNEL, node);
+	if (!buffer) {
+		*retval = -ENOMEM;
 		return NULL;
 	}
+	buffer->size = rounddown_pow_of_two(size); /* kfifo would use only that */
 	buffer->id = buffer_id++;
 	spin_lock_init(&buffer->key);
+	mutex_init(&buffer->merge);
+	buffer->cpu = NULL;
+	buffer->users = 0;
+	buffer->allocated = 0;
 
 	*retval = 0;
 
@@ -193,9 +301,147 @@ static struct buffer *buffer_create(size_t size, int *retval)
 }
 static void buffer_delete(struct buffer *buffer)
 {
+	if (buffer->allocated)
+		buffer_free(buffer);
 	kfree(buffer);
 }
 
+/* Allocate memory for buffer data; called with buffers_lock held */
+static int buffer_alloc(struct buffer *buffer)
+{
+	struct cpu_buffer __percpu *cpus;
+	struct cpu_buffer *cb;
+	int cpu, retval;
+	void *data;
+	size_t size = buffer->size;
+
+	/* fixed node or node of this (first) opener */
+	buffer->node = node != NUMA_NO_NODE ? node : numa_node_id();
+
+	if (percpu) {
+		/* sub-buffers only, main fifo isn't used */
+		cpus = alloc_percpu(struct cpu_buffer);
+		if (!cpus) {
+			klog(KERN_WARNING, "alloc_percpu failed");
+			return -ENOMEM;
+		}
+		for_each_possible_cpu(cpu) {
+			cb = per_cpu_ptr(cpus, cpu);
+			spin_lock_init(&cb->key);
+			cb->head_left = 0;
+			data = data_alloc(size, cpu_to_node(cpu));
+			if (data)
+				kfifo_init(&cb->data, data, size);
+			if (!data ||
+				kfifo_alloc(&cb->recs, CPU_RECORDS, GFP_KERNEL)) {
+				klog(KERN_WARNING, "per-CPU allocation failed");
+				cpu_buffers_free(cpus);
+				return -ENOMEM;
+			}
+		}
+		/* timer looks sub-buffers up under RCU */
+		rcu_assign_pointer(buffer->cpu, cpus);
+	}
+	else {
+		data = data_alloc(size, buffer->node);
+		if (!data) {
+			klog(KERN_WARNING, "data_alloc(%zu) failed", size);
+			return -ENOMEM;
+		}
+		retval = kfifo_init(&buffer->fifo, data, size);
+		if (retval) {
+			data_free(data, size);
+			klog(KERN_WARNING, "kfifo_init failed");
+			return retval;
+		}
+	}
+
+	/* from now on timer can put data in it */
+	spin_lock_bh(&buffer->key);
+	buffer->allocated = 1;
+	spin_unlock_bh(&buffer->key);
+
+	LOG("buffer %d allocated on node %d", buffer->id, buffer->node);
+
+	return 0;
+}
+
+/* Free memory for buffer data; called with buffers_lock held or on exit */
+static void buffer_free(struct buffer *buffer)
+{
+	struct cpu_buffer __percpu *cpus = buffer->cpu;
+
+	/* timer checks this under the same lock */
+	spin_lock_bh(&buffer->key);
+	buffer->allocated = 0;
+	spin_unlock_bh(&buffer->key);
+
+	if (cpus) {
+		/* timer could still be using them, wait for it */
+		RCU_INIT_POINTER(buffer->cpu, NULL);
+		synchronize_rcu();
+		cpu_buffers_free(cpus);
+	}
+	data_free(buffer->fifo.kfifo.data, kfifo_size(&buffer->fifo));
+	memset(&buffer->fifo, 0, sizeof(buffer->fifo));
+
+	LOG("buffer %d freed", buffer->id);
+}
+
+/* Free per-CPU sub-buffers, also partially initialized ones */
+static void cpu_buffers_free(struct cpu_buffer __percpu *cpus)
+{
+	struct cpu_buffer *cb;
+	int cpu;
+
+	/* both are fine with never allocated (zeroed) fifo */
+	for_each_possible_cpu(cpu) {
+		cb = per_cpu_ptr(cpus, cpu);
+		kfifo_free(&cb->recs);
+		data_free(cb->data.kfifo.data, kfifo_size(&cb->data));
+	}
+	free_percpu(cpus);
+}
+
+/*
+ * Allocate memory for buffer data on NUMA node nid (preferred), with
+ * allocator chosen by 'backing'
+ * Pages are physically contiguous; of huge page order they are mapped
+ * with huge pages in kernel linear mapping (fewer TLB misses when
+ * streaming). If they can't be found, vmalloc is used instead.
+ */
+static void *data_alloc(size_t size, int nid)
+{
+	struct page *page;
+
+	switch (backing) {
+	case BACKING_VMALLOC:
+		return vmalloc_node(size, nid);
+	case BACKING_PAGES:
+		page = alloc_pages_node(nid, GFP_KERNEL | __GFP_COMP |
+			__GFP_NOWARN, get_order(size));
+		if (page)
+			return page_address(page);
+		klog(KERN_NOTICE, "alloc_pages failed, using vmalloc");
+		return vmalloc_node(size, nid);
+	default:
+		return kmalloc_node(size, GFP_KERNEL, nid);
+	}
+}
+
+/* Free memory from data_alloc */
+static void data_free(void *data, size_t size)
+{
+	if (!data)
+		return;
+	if (is_vmalloc_addr(data))
+		vfree(data);
+	else if (backing == BACKING_PAGES)
+		free_pages((unsigned long) data, get_order(size));
+	else
+		kfree(data);
+}
+
 /* Create and initialize a single shofer_dev */
 static struct shofer_dev *shofer_create(dev_t dev_no,
 	struct file_operations *fops, struct buffer *buffer, int *retval)
@@ -204,7 +450,7 @@ static struct shofer_dev *shofer_create(dev_t dev_no,
 	struct shofer_dev *shofer;
 	char wqname[8];
 
-	shofer = kmalloc(sizeof(struct shofer_dev), GFP_KERNEL);
+	shofer = kmalloc_node(sizeof(struct shofer_dev), GFP_KERNEL, node);
 	if (!shofer){
 		*retval = -ENOMEM;
 		klog(KERN_WARNING, "kmalloc failed");
@@ -246,8 +492,12 @@ static struct shofer_dev *shofer_create(dev_t dev_no,
 		return NULL;
 	}
 
+	/* percpu: writer work must run on writer's CPU (bound workqueue) */
 	wqname[0] = 'w';
-	shofer->wwq = create_singlethread_workqueue(wqname);
+	if (percpu)
+		shofer->wwq = alloc_workqueue("%s", 0, 1, wqname);
+	else
+		shofer->wwq = create_singlethread_workqueue(wqname);
 	if (!shofer->wwq) {
 		klog(KERN_WARNING, "create_singlethread_workqueue error");
 		destroy_workqueue(shofer->rwq);
@@ -280,151 +530,328 @@ static int shofer_open(struct inode *inode, struct file *filp)
 {
 	struct shofer_dev *shofer; /* device information */
 
+	struct buffer *buffer;
+	int retval = 0;
+
 	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
 	filp->private_data = shofer; /* for other methods */
+	filp->f_mode |= FMODE_NOWAIT; /* IOCB_NOWAIT is honoured (EAGAIN) */
+	buffer = shofer->buffer;
+
+	/* buffer memory is allocated on first open */
+	mutex_lock(&buffers_lock);
+	if (!buffer->allocated)
+		retval = buffer_alloc(buffer);
+	if (!retval)
+		buffer->users++;
+	mutex_unlock(&buffers_lock);
+
+	return retval;
+}
+
+/* Last close frees memory of an empty buffer; data left in it stays */
+static int shofer_release(struct inode *inode, struct file *filp)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *buffer = shofer->buffer;
+
+	mutex_lock(&buffers_lock);
+	buffer->users--;
+	if (!buffer->users && !buffer_len(buffer))
+		buffer_free(buffer);
+	mutex_unlock(&buffers_lock);
 
 	return 0;
 }
 
-/* use workqueues to copy data from buffer */
-static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
-	loff_t *f_pos)
+/*
+ * Use workqueues to copy data from buffer
+ * Synchronous caller (read, readv) waits for work to be done; for
+ * asynchronous one (AIO, io_uring) reader's pages are taken here, work
+ * copies data to them and completes request (here -EIOCBQUEUED is
+ * returned). With IOCB_NOWAIT nothing here waits (EAGAIN instead);
+ * a synchronous caller would have to wait for work, so it gets EAGAIN.
+ */
+static ssize_t shofer_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
+	size_t count = iov_iter_count(to);
 	size_t fifo_len;
+	bool async = !is_sync_kiocb(iocb);
+	gfp_t gfp = iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL;
 	char *buf = NULL;
-	struct wq_data wqd; /* reserved on stack, since here we wait */
+	struct wq_data wqd_sync, *wqd = &wqd_sync; /* on stack, if we wait */
 	struct completion wq_reader;
 
 	if (count == 0)
 		return 0;
 
-	spin_lock(&buffer->key); /* prevent timers, tasklets, ... */
+	buffer_lock(buffer); /* prevent timers, tasklets, ... */
 
 	dump_buffer("read-start", shofer, buffer);
-	fifo_len = kfifo_len(fifo);
+	fifo_len = buffer_len(buffer);
 	if (count > fifo_len) /* enough bytes in buffer? */
 		count = fifo_len;
 
-	spin_unlock(&buffer->key);
+	buffer_unlock(buffer);
 
 	if (count == 0)
 		return 0;
 
-	buf = kmalloc(count, GFP_KERNEL);
+	/* synchronous caller can't be served without waiting for work */
+	if (!async && (iocb->ki_flags & IOCB_NOWAIT))
+		return -EAGAIN;
+
+	count_access(buffer); /* caller's node, work may run anywhere */
+
+	if (async) {
+		wqd = kmalloc(sizeof(struct wq_data), gfp);
+		if (!wqd)
+			return gfp == GFP_NOWAIT ? -EAGAIN : -ENOMEM;
+		retval = wq_get_pages(wqd, to, count);
+		if (retval <= 0) {
+			kfree(wqd);
+			return retval ? retval : -EFAULT;
+		}
+		count = retval; /* could be less (only first iovec) */
+		retval = 0;
+	}
+
+	buf = kmalloc(count, gfp);
 	if (!buf){
 		klog(KERN_WARNING, "kmalloc failed");
-		return -ENOMEM;
+		retval = gfp == GFP_NOWAIT ? -EAGAIN : -ENOMEM;
+		goto fail;
 	}
 
 	/* create a job that will copy data from 'buffer' to 'buf' */
-	wqd.buf = buf;
-	wqd.len = count;
-	wqd.copied = 0;
-	wqd.buffer = buffer;
-	wqd.op = 0; /* read */
-	wqd.wakeup.completion = &wq_reader;
-
-	INIT_WORK(&wqd.work, workqueue_operations);
+	wqd->buf = buf;
+	wqd->len = count;
+	wqd->copied = 0;
+	wqd->done = 0;
+	wqd->buffer = buffer;
+	wqd->op = 0; /* read */
+	wqd->iocb = async ? iocb : NULL;
+	wqd->wakeup.completion = &wq_reader;
+
+	INIT_WORK(&wqd->work, workqueue_operations);
 	init_completion(&wq_reader);
 
-	mutex_lock(&shofer->lock);
-	if (!queue_work(shofer->rwq, &wqd.work)) {
-		/* not added */
-		LOG("work not added to workqueue!");
+	retval = queue_wq_data(shofer, shofer->rwq, wqd, iocb,
+		WORK_CPU_UNBOUND);
+	if (retval)
+		goto fail;
+	if (async)
+		return -EIOCBQUEUED;
+
+	wait_for_completion(&wq_reader);
+	retval = wqd->copied;
+	if (copy_to_iter(buf, wqd->copied, to) != wqd->copied) {
+		klog(KERN_WARNING, "copy_to_iter failed");
 		retval = -EFAULT;
 	}
-	mutex_unlock(&shofer->lock);
 
-	if (!retval) {
-		wait_for_completion(&wq_reader);
-		retval = wqd.copied;
-		if (copy_to_user(ubuf, buf, wqd.copied)) {
-			klog(KERN_WARNING, "copy_to_user failed");
-			kfree(buf);
-			return -EFAULT;
-		}
-	}
-
-	spin_lock(&buffer->key);
+	buffer_lock(buffer);
 	dump_buffer("read-end", shofer, buffer);
-	spin_unlock(&buffer->key);
+	buffer_unlock(buffer);
 
 	kfree(buf);
 
 	return retval;
+
+fail:
+	kfree(buf);
+	if (async) {
+		wq_put_pages(wqd, false);
+		kfree(wqd);
+	}
+	return retval;
 }
 
-/* use workqueues to copy data to buffer */
-static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
-	size_t count, loff_t *f_pos)
+/*
+ * Use workqueues to copy data to buffer
+ * Data is first taken from iov_iter; synchronous caller then waits for
+ * work, asynchronous gets -EIOCBQUEUED and work completes request.
+ * IOCB_NOWAIT is handled as in shofer_read_iter.
+ */
+static ssize_t shofer_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
 	struct kfifo *fifo = &buffer->fifo;
+	size_t count = iov_iter_count(from);
 	size_t fifo_free;
+	bool async = !is_sync_kiocb(iocb);
+	gfp_t gfp = iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL;
 	char *buf = NULL;
-	struct wq_data wqd; /* reserved on stack, since here we wait */
+	struct wq_data wqd_sync, *wqd = &wqd_sync; /* on stack, if we wait */
 
 	if (count == 0)
 		return 0;
 
-	spin_lock(&buffer->key);
+	buffer_lock(buffer);
 
 	dump_buffer("write-start", shofer, buffer);
-	fifo_free = kfifo_avail(fifo);
+	if (percpu) /* space is checked on CPU where work runs */
+		fifo_free = buffer_size;
+	else
+		fifo_free = kfifo_avail(fifo);
 	if (count > fifo_free) /* enough free space in buffer? */
 		count = fifo_free; /* don't write all given data */
 
-	spin_unlock(&buffer->key);
+	buffer_unlock(buffer);
 
 	if (count == 0)
 		return 0;
 
+	/* synchronous caller can't be served without waiting for work */
+	if (!async && (iocb->ki_flags & IOCB_NOWAIT))
+		return -EAGAIN;
+
+	count_access(buffer); /* caller's node, work may run anywhere */
+
 	/* first, copy data from user space to 'buf' */
-	buf = kmalloc(count, GFP_KERNEL);
-	if (!buf){
+	buf = kmalloc(count, gfp);
+	if (async)
+		wqd = kmalloc(sizeof(struct wq_data), gfp);
+	if (!buf || !wqd) {
 		klog(KERN_WARNING, "kmalloc failed");
-		return -ENOMEM;
+		retval = gfp == GFP_NOWAIT ? -EAGAIN : -ENOMEM;
+		goto fail;
 	}
-	if (copy_from_user(buf, ubuf, count)) {
-		klog(KERN_WARNING, "copy_from_user failed");
-		kfree(buf);
-		return -EFAULT;
+	if (copy_from_iter(buf, count, from) != count) {
+		klog(KERN_WARNING, "copy_from_iter failed");
+		retval = -EFAULT;
+		goto fail;
 	}
 	/* create a job that will copy data from 'buf' into "buffer" */
-	wqd.buf = buf;
-	wqd.len = count;
-	wqd.copied = 0;
-	wqd.buffer = buffer;
-	wqd.op = 1; /* write */
-	wqd.wakeup.queue = &shofer->wqueue;
+	wqd->buf = buf;
+	wqd->len = count;
+	wqd->copied = 0;
+	wqd->done = 0;
+	wqd->buffer = buffer;
+	wqd->op = 1; /* write */
+	wqd->iocb = async ? iocb : NULL;
+	wqd->wakeup.queue = &shofer->wqueue;
+
+	INIT_WORK(&wqd->work, workqueue_operations);
+
+	/*
+	 * percpu: work runs on this CPU and puts data in its sub-buffer
+	 * (if writer moves to another CPU now, its data is still on this one)
+	 */
+	retval = queue_wq_data(shofer, shofer->wwq, wqd, iocb,
+		percpu ? raw_smp_processor_id() : WORK_CPU_UNBOUND);
+	if (retval)
+		goto fail;
+	if (async)
+		return -EIOCBQUEUED;
+
+	wait_event(shofer->wqueue, wqd->done);
+	retval = wqd->copied;
+
+	buffer_lock(buffer);
+	dump_buffer("write-end", shofer, buffer);
+	buffer_unlock(buffer);
+
+	kfree(buf);
+
+	return retval;
 
-	INIT_WORK(&wqd.work, workqueue_operations);
+fail:
+	kfree(buf);
+	if (async)
+		kfree(wqd);
+	return retval;
+}
+
+/*
+ * Queue work (on given cpu, WORK_CPU_UNBOUND for any); with IOCB_NOWAIT
+ * only if device lock is free at once
+ */
+static int queue_wq_data(struct shofer_dev *shofer,
+	struct workqueue_struct *wq, struct wq_data *wqd, struct kiocb *iocb,
+	int cpu)
+{
+	int retval = 0;
 
-	mutex_lock(&shofer->lock);
-	if (!queue_work(shofer->wwq, &wqd.work)) {
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&shofer->lock))
+			return -EAGAIN;
+	}
+	else {
+		mutex_lock(&shofer->lock);
+	}
+	if (!queue_work_on(cpu, wq, &wqd->work)) {
 		/* not added */
 		LOG("work not added to workqueue!");
 		retval = -EFAULT;
 	}
 	mutex_unlock(&shofer->lock);
-	if (!retval) {
-		wait_event(shofer->wqueue, wqd.copied > 0);
-		retval = wqd.copied;
-	}
 
-	spin_lock(&buffer->key);
-	dump_buffer("write-end", shofer, buffer);
-	spin_unlock(&buffer->key);
+	return retval;
+}
 
-	kfree(buf);
+/*
+ * Async read: take reader's pages for up to count bytes of iov_iter (of
+ * its first segment), work copies data into them
+ * Returns number of bytes the pages cover.
+ */
+static ssize_t wq_get_pages(struct wq_data *wqd, struct iov_iter *to,
+	size_t count)
+{
+	ssize_t n;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	n = iov_iter_get_pages_alloc2(to, &wqd->pages, count, &wqd->start);
+#else
+	n = iov_iter_get_pages_alloc(to, &wqd->pages, count, &wqd->start);
+	if (n > 0)
+		iov_iter_advance(to, n);
+#endif
+	wqd->npages = n > 0 ? DIV_ROUND_UP(wqd->start + n, PAGE_SIZE) : 0;
+
+	return n;
+}
 
-	return retval;
+static void wq_put_pages(struct wq_data *wqd, bool dirty)
+{
+	int i;
+
+	if (!wqd->npages)
+		return;
+	for (i = 0; i < wqd->npages; i++) {
+		if (dirty)
+			set_page_dirty_lock(wqd->pages[i]);
+		put_page(wqd->pages[i]);
+	}
+	kvfree(wqd->pages);
+}
+
+/* Finish async request (in work): give data to reader, complete kiocb */
+static void wq_complete(struct wq_data *wqd)
+{
+	struct kiocb *iocb = wqd->iocb;
+	long copied = wqd->copied;
+	size_t off = wqd->start, done = 0, l;
+	int i;
+
+	if (!wqd->op) {
+		for (i = 0; done < copied; i++) {
+			l = min_t(size_t, copied - done, PAGE_SIZE - off);
+			memcpy_to_page(wqd->pages[i], off, wqd->buf + done, l);
+			done += l;
+			off = 0;
+		}
+		wq_put_pages(wqd, true);
+	}
+	kfree(wqd->buf);
+	kfree(wqd);
+
+	iocb_complete(iocb, copied);
 }
 
 static void dump_buffer(char *prefix, struct shofer_dev *shofer, struct buffer *b)
@@ -432,6 +859,12 @@ static void dump_buffer(char *prefix, struct shofer_dev *shofer, struct buffer *
 	char buf[BUFFER_SIZE];
 	size_t copied;
 
+	if (percpu) {
+		LOG("%s:id=%d,buffer:id=%d:percpu:contains=%u",
+		prefix, shofer->id, b->id, buffer_len(b));
+		return;
+	}
+
 	memset(buf, 0, BUFFER_SIZE);
 	copied = kfifo_out_peek(&b->fifo, buf, BUFFER_SIZE);
 
@@ -439,17 +872,54 @@ static void dump_buffer(char *prefix, struct shofer_dev *shofer, struct buffer *
 	prefix, shofer->id, b->id, kfifo_size(&b->fifo), kfifo_len(&b->fifo), buf);
 }
 
+/* Lock main fifo; in percpu mode sub-buffers have their own locks */
+static void buffer_lock(struct buffer *buffer)
+{
+	if (!percpu)
+		spin_lock(&buffer->key);
+}
+
+static void buffer_unlock(struct buffer *buffer)
+{
+	if (!percpu)
+		spin_unlock(&buffer->key);
+}
+
 static void timer_function(struct timer_list *t)
 {
 	struct buffer *buffer;
 	struct kfifo *fifo;
+	struct cpu_buffer __percpu *cpus;
 
 	buffer = list_first_entry(&buffers_list, struct buffer, list);
+	if (percpu) {
+		/* no buffer->key; sub-buffers are freed after RCU grace period */
+		rcu_read_lock();
+		cpus = rcu_dereference(buffer->cpu);
+		if (!cpus)
+			LOG("timer: buffer not in use");
+		else if (!cpu_buffer_put(cpus, "T", 1))
+			timer_lost++;
+		rcu_read_unlock();
+		goto out;
+	}
+
 	spin_lock(&buffer->key);
-	fifo = &buffer->fifo;
-	kfifo_put(fifo, 'T');
+	if (!buffer->allocated) {
+		LOG("timer: buffer not in use");
+	}
+	else {
+		fifo = &buffer->fifo;
+		if (kfifo_is_full(fifo)) {
+			timer_lost++;
+			if (timer_policy == POLICY_OVERWRITE)
+				kfifo_skip(fifo);
+		}
+		kfifo_put(fifo, 'T');
+	}
 	spin_unlock(&buffer->key);
 
+out:
 	/* reschedule timer for period */
 	mod_timer(t, jiffies + msecs_to_jiffies(TIMER_PERIOD));
 }
@@ -471,17 +941,158 @@ static void workqueue_operations(struct work_struct *work)
 	buffer = wqd->buffer;
 	fifo = &buffer->fifo;
 
-	spin_lock(&buffer->key);
+	if (percpu) {
+		if (wqd->op)
+			wqd->copied = cpu_buffer_put(buffer->cpu, wqd->buf,
+				wqd->len);
+		else
+			wqd->copied = cpu_buffer_get(buffer, wqd->buf, wqd->len);
+	}
+	else {
+		spin_lock(&buffer->key);
 
-	if (wqd->op)
-		wqd->copied = kfifo_in(fifo, wqd->buf, wqd->len);
-	else
-		wqd->copied = kfifo_out(fifo, wqd->buf, wqd->len);
+		if (wqd->op)
+			wqd->copied = kfifo_in(fifo, wqd->buf, wqd->len);
+		else
+			wqd->copied = kfifo_out(fifo, wqd->buf, wqd->len);
 
-	spin_unlock(&buffer->key);
+		spin_unlock(&buffer->key);
+	}
+	wqd->done = 1;
 
-	if (wqd->op)
+	if (wqd->iocb)
+		wq_complete(wqd); /* asynchronous, nobody waits */
+	else if (wqd->op)
 		wake_up_all(wqd->wakeup.queue);
 	else
 		complete(wqd->wakeup.completion);
 }
+
+/*
+ * Count access to buffer data as local or remote to node of current CPU
+ * (not in percpu mode, where data is spread over nodes of all CPUs)
+ * Called by reader/writer, not in work: unbound worker's CPU says
+ * nothing about where users of the buffer are.
+ */
+static void count_access(struct buffer *buffer)
+{
+	int nid = numa_node_id();
+
+	if (percpu)
+		return;
+	if (nid == buffer->node)
+		atomic_long_inc(&local_access[nid]);
+	else
+		atomic_long_inc(&remote_access[nid]);
+}
+
+static void dump_access(void)
+{
+	int nid;
+
+	for_each_online_node(nid)
+		klog(KERN_NOTICE, "node %d: %ld local, %ld remote accesses", nid,
+			atomic_long_read(&local_access[nid]),
+			atomic_long_read(&remote_access[nid]));
+}
+
+/* Number of bytes in buffer (in all sub-buffers in percpu mode) */
+static unsigned int buffer_len(struct buffer *buffer)
+{
+	unsigned int len = 0;
+	int cpu;
+
+	if (!percpu)
+		return kfifo_len(&buffer->fifo);
+	if (!buffer->cpu)
+		return 0; /* not allocated */
+
+	for_each_possible_cpu(cpu)
+		len += kfifo_len(&per_cpu_ptr(buffer->cpu, cpu)->data);
+
+	return len;
+}
+
+/* Append data as a single record into sub-buffer of current CPU */
+static unsigned int cpu_buffer_put(struct cpu_buffer __percpu *cpus,
+	char *buf, unsigned int len)
+{
+	struct cpu_buffer *cb = get_cpu_ptr(cpus);
+	struct cpu_rec rec;
+
+	/* _bh: timer appends on the same CPU from softirq */
+	spin_lock_bh(&cb->key);
+
+	if (len > kfifo_avail(&cb->data))
+		len = kfifo_avail(&cb->data);
+	if (len && !kfifo_is_full(&cb->recs)) {
+		rec.ts = ktime_get_ns();
+		rec.len = len;
+		kfifo_put(&cb->recs, rec);
+		len = kfifo_in(&cb->data, buf, len);
+	}
+	else {
+		len = 0;
+	}
+
+	spin_unlock_bh(&cb->key);
+	put_cpu_ptr(cpus);
+
+	return len;
+}
+
+/* Get up to len bytes from all sub-buffers, oldest record first */
+static unsigned int cpu_buffer_get(struct buffer *buffer, char *buf,
+	unsigned int len)
+{
+	struct cpu_buffer *cb;
+	struct cpu_rec rec;
+	unsigned int copied = 0, n;
+	int cpu, oldest;
+	u64 ts = 0, oldest_ts = 0;
+
+	mutex_lock(&buffer->merge);
+
+	while (copied < len) {
+		/* find CPU with oldest head record */
+		oldest = -1;
+		for_each_possible_cpu(cpu) {
+			cb = per_cpu_ptr(buffer->cpu, cpu);
+			n = 0;
+			spin_lock_bh(&cb->key);
+			if (cb->head_left) {
+				n = 1;
+				ts = cb->head_ts;
+			}
+			else if (kfifo_peek(&cb->recs, &rec)) {
+				n = 1;
+				ts = rec.ts;
+			}
+			spin_unlock_bh(&cb->key);
+			if (n && (oldest < 0 || ts < oldest_ts)) {
+				oldest = cpu;
+				oldest_ts = ts;
+			}
+		}
+		if (oldest < 0)
+			break; /* all empty */
+
+		/* head record can't go away: only merging reader removes it */
+		cb = per_cpu_ptr(buffer->cpu, oldest);
+		spin_lock_bh(&cb->key);
+		if (!cb->head_left && kfifo_get(&cb->recs, &rec)) {
+			cb->head_left = rec.len;
+			cb->head_ts = rec.ts;
+		}
+		n = min(cb->head_left, len - copied);
+		n = kfifo_out(&cb->data, buf + copied, n);
+		cb->head_left -= n;
+		spin_unlock_bh(&cb->key);
+
+		copied += n;
+	}
+
+	mutex_unlock(&buffer->merge);
+
+	return copied;
+}
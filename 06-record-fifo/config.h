@@ -0,0 +1,57 @@
+/*
+ * config.h -- structures, constants, macros
+ *
+ * Copyright (C) 2021 Leonardo Jelenkovic
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form.
+ * No warranty is attached.
+ *
+ */
+
+#pragma once
+
+#define DRIVER_NAME 	"shofer"
+
+#define AUTHOR		"Leonardo Jelenkovic"
+#define LICENSE		"Dual BSD/GPL"
+
+#define BUFFER_RECORDS	16	/* records in each FIFO, power of 2 */
+
+/*
+ * Record sizes (in bytes, multiples of 8); a record type, a FIFO type and
+ * a device (minor in this order) is generated for each
+ */
+#define RECORD_TYPES(X)	\
+	X(8)		\
+	X(16)		\
+	X(64)
+
+/* Record: opaque data with known size and alignment */
+#define RECORD_STRUCT(N)	\
+struct rec##N {			\
+	u64 data[(N) / 8];	\
+};
+
+RECORD_TYPES(RECORD_STRUCT)
+
+/* Device driver, buffer points to a FIFO of its record type */
+struct shofer_dev {
+	dev_t dev_no;		/* device number */
+	struct cdev cdev;	/* Char device structure */
+	void *buffer;		/* Pointer to buffer */
+	int id;			/* id to differentiate drivers in prints */
+};
+
+
+#define klog(LEVEL, format, ...)	\
+printk(LEVEL "[shofer] %d: " format "\n", __LINE__, ##__VA_ARGS__)
+
+//#define SHOFER_DEBUG
+
+#ifdef SHOFER_DEBUG
+#define LOG(format, ...)	klog(KERN_DEBUG, format,  ##__VA_ARGS__)
+#else /* !SHOFER_DEBUG */
+#warning Debug not activated
+#define LOG(format, ...)
+#endif /* SHOFER_DEBUG */
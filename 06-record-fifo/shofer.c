@@ -0,0 +1,295 @@
+/*
+ * shofer.c -- module implementation
+ *
+ * Example module with typed FIFOs: a FIFO of fixed-size records and a
+ * device is generated for each record size in RECORD_TYPES (config.h).
+ * Data is moved in whole records, a reader never sees a partial record.
+ *
+ * Copyright (C) 2021 Leonardo Jelenkovic
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form.
+ * No warranty is attached.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/kfifo.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+
+#include "config.h"
+
+static int buffer_records = BUFFER_RECORDS;	/* Records in a FIFO */
+
+/* Some parameters can be given at module load time */
+module_param(buffer_records, int, S_IRUGO);
+MODULE_PARM_DESC(buffer_records, "Records in each FIFO, power of 2");
+
+MODULE_AUTHOR(AUTHOR);
+MODULE_LICENSE(LICENSE);
+
+static dev_t Dev_no = 0;
+
+/* prototypes */
+static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
+	void *, int *);
+static void shofer_delete(struct shofer_dev *);
+static void cleanup(void);
+
+static int shofer_open(struct inode *, struct file *);
+
+/*
+ * FIFO of records of N bytes, with its buffer operations and file
+ * operations. kfifo of struct rec##N counts in records, so it copies
+ * whole records only and element size is known at compile time.
+ */
+#define RECORD_FIFO(N)							\
+struct rec##N##_buffer {						\
+	DECLARE_KFIFO_PTR(fifo, struct rec##N);				\
+	struct mutex lock;	/* prevent parallel access */		\
+};									\
+									\
+static void *rec##N##_create(unsigned int records, int *retval)	\
+{									\
+	struct rec##N##_buffer *buffer;					\
+									\
+	buffer = kmalloc(sizeof(struct rec##N##_buffer), GFP_KERNEL);	\
+	if (!buffer) {							\
+		*retval = -ENOMEM;					\
+		klog(KERN_WARNING, "kmalloc failed");			\
+		return NULL;						\
+	}								\
+	*retval = kfifo_alloc(&buffer->fifo, records, GFP_KERNEL);	\
+	if (*retval) {							\
+		kfree(buffer);						\
+		klog(KERN_WARNING, "kfifo_alloc failed");		\
+		return NULL;						\
+	}								\
+	mutex_init(&buffer->lock);					\
+									\
+	return buffer;							\
+}									\
+									\
+static void rec##N##_delete(void *buffer)				\
+{									\
+	struct rec##N##_buffer *b = buffer;				\
+									\
+	kfifo_free(&b->fifo);						\
+	kfree(b);							\
+}									\
+									\
+/* Read whole records, count is rounded down to multiple of N */	\
+static ssize_t rec##N##_read(struct file *filp, char __user *ubuf,	\
+	size_t count, loff_t *f_pos /* ignoring f_pos */)		\
+{									\
+	struct shofer_dev *shofer = filp->private_data;			\
+	struct rec##N##_buffer *buffer = shofer->buffer;		\
+	unsigned int copied;						\
+	int retval;							\
+									\
+	if (count < sizeof(struct rec##N))				\
+		return -EINVAL; /* not even one record */		\
+									\
+	if (mutex_lock_interruptible(&buffer->lock))			\
+		return -ERESTARTSYS;					\
+									\
+	retval = kfifo_to_user(&buffer->fifo, ubuf, count, &copied);	\
+									\
+	LOG("rec%d: read %zu records, %u left", N,			\
+		copied / sizeof(struct rec##N), kfifo_len(&buffer->fifo)); \
+									\
+	mutex_unlock(&buffer->lock);					\
+									\
+	if (retval)							\
+		return retval;						\
+									\
+	return copied;							\
+}									\
+									\
+/* Write whole records, count is rounded down to multiple of N */	\
+static ssize_t rec##N##_write(struct file *filp,			\
+	const char __user *ubuf, size_t count,				\
+	loff_t *f_pos /* ignoring f_pos */)				\
+{									\
+	struct shofer_dev *shofer = filp->private_data;			\
+	struct rec##N##_buffer *buffer = shofer->buffer;		\
+	unsigned int copied;						\
+	int retval;							\
+									\
+	if (count < sizeof(struct rec##N))				\
+		return -EINVAL; /* not even one record */		\
+									\
+	if (mutex_lock_interruptible(&buffer->lock))			\
+		return -ERESTARTSYS;					\
+									\
+	retval = kfifo_from_user(&buffer->fifo, ubuf, count, &copied);	\
+									\
+	LOG("rec%d: wrote %zu records, %u in buffer", N,		\
+		copied / sizeof(struct rec##N), kfifo_len(&buffer->fifo)); \
+									\
+	mutex_unlock(&buffer->lock);					\
+									\
+	if (retval)							\
+		return retval;						\
+									\
+	return copied;							\
+}									\
+									\
+static struct file_operations rec##N##_fops = {				\
+	.owner =    THIS_MODULE,					\
+	.open =     shofer_open,					\
+	.read =     rec##N##_read,					\
+	.write =    rec##N##_write					\
+};
+
+RECORD_TYPES(RECORD_FIFO)
+
+/* Generated FIFO types, index is device minor */
+static struct record_type {
+	unsigned int size;
+	struct file_operations *fops;
+	void *(*create)(unsigned int, int *);
+	void (*delete)(void *);
+} record_types[] = {
+#define RECORD_TYPE(N)	\
+	{ sizeof(struct rec##N), &rec##N##_fops, rec##N##_create, rec##N##_delete },
+	RECORD_TYPES(RECORD_TYPE)
+#undef RECORD_TYPE
+};
+
+#define TYPES_NUM	ARRAY_SIZE(record_types)
+
+static struct shofer_dev *shofers[TYPES_NUM];
+static void *buffers[TYPES_NUM];
+
+/* init module */
+static int __init shofer_module_init(void)
+{
+	int retval, i;
+	dev_t dev_no = 0;
+
+	klog(KERN_NOTICE, "Module started initialization");
+
+	/* get device number(s) */
+	retval = alloc_chrdev_region(&dev_no, 0, TYPES_NUM, DRIVER_NAME);
+	if (retval < 0) {
+		klog(KERN_WARNING, "Can't get major device number");
+		return retval;
+	}
+	Dev_no = dev_no; //remember first
+
+	/* kfifo size must be a power of 2 */
+	if (buffer_records < 2) {
+		klog(KERN_WARNING, "buffer_records must be at least 2");
+		retval = -EINVAL;
+		goto no_driver;
+	}
+	if (!is_power_of_2(buffer_records)) {
+		buffer_records = roundup_pow_of_two(buffer_records);
+		klog(KERN_NOTICE, "buffer_records rounded up to %d",
+			buffer_records);
+	}
+
+	/* A FIFO and a device for each record type */
+	for (i = 0; i < TYPES_NUM; i++) {
+		buffers[i] = record_types[i].create(buffer_records, &retval);
+		if (!buffers[i])
+			goto no_driver;
+		shofers[i] = shofer_create(dev_no, record_types[i].fops,
+			buffers[i], &retval);
+		if (!shofers[i])
+			goto no_driver;
+		klog(KERN_NOTICE, "Device %d: %u records of %u bytes",
+			shofers[i]->id, buffer_records, record_types[i].size);
+		dev_no = MKDEV(MAJOR(dev_no), MINOR(dev_no) + 1);
+	}
+
+	klog(KERN_NOTICE, "Module initialized with major=%d", MAJOR(dev_no));
+
+	return 0;
+
+no_driver:
+	cleanup();
+
+	return retval;
+}
+
+static void cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < TYPES_NUM; i++) {
+		if (shofers[i])
+			shofer_delete(shofers[i]);
+		if (buffers[i])
+			record_types[i].delete(buffers[i]);
+		shofers[i] = NULL;
+		buffers[i] = NULL;
+	}
+
+	if (Dev_no)
+		unregister_chrdev_region(Dev_no, TYPES_NUM);
+}
+
+/* called when module exit */
+static void __exit shofer_module_exit(void)
+{
+	klog(KERN_NOTICE, "Module started exit operation");
+	cleanup();
+	klog(KERN_NOTICE, "Module finished exit operation");
+}
+
+module_init(shofer_module_init);
+module_exit(shofer_module_exit);
+
+/* Create and initialize a single shofer_dev */
+static struct shofer_dev *shofer_create(dev_t dev_no,
+	struct file_operations *fops, void *buffer, int *retval)
+{
+	static int shofer_id = 0;
+	struct shofer_dev *shofer = kmalloc(sizeof(struct shofer_dev), GFP_KERNEL);
+	if (!shofer){
+		*retval = -ENOMEM;
+		klog(KERN_WARNING, "kmalloc failed");
+		return NULL;
+	}
+	memset(shofer, 0, sizeof(struct shofer_dev));
+	shofer->buffer = buffer;
+
+	cdev_init(&shofer->cdev, fops);
+	shofer->cdev.owner = THIS_MODULE;
+	shofer->cdev.ops = fops;
+	*retval = cdev_add (&shofer->cdev, dev_no, 1);
+	shofer->dev_no = dev_no;
+	shofer->id = shofer_id++;
+	if (*retval) {
+		klog(KERN_WARNING, "Error (%d) when adding device", *retval);
+		kfree(shofer);
+		shofer = NULL;
+	}
+
+	return shofer;
+}
+static void shofer_delete(struct shofer_dev *shofer)
+{
+	cdev_del(&shofer->cdev);
+	kfree(shofer);
+}
+
+static int shofer_open(struct inode *inode, struct file *filp)
+{
+	struct shofer_dev *shofer;
+
+	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
+	filp->private_data = shofer;
+
+	return 0;
+}
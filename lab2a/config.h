@@ -11,6 +11,8 @@
 
 #pragma once
 
+#ifdef SHOFER_C
+
 #define DRIVER_NAME 	"shofer"
 
 #define AUTHOR		"Leonardo Jelenkovic"
@@ -20,14 +22,77 @@
 #define BUFFER_NUM	6
 #define DRIVER_NUM	6
 
-/* Circular buffer */
+#define SEGMENT_SIZE	16	/* bytes in a segment, power of 2 */
+#define POOL_SIZE	256	/* bytes in all segments of all buffers */
+
+/* Allocators for buffer data (backing) */
+#define BACKING_KMALLOC	0	/* small buffers */
+#define BACKING_VMALLOC	1	/* large buffers, not physically contiguous */
+#define BACKING_PAGES	2	/* physically contiguous (compound) pages */
+
+/* Piece of buffer memory, taken from pool */
+struct segment {
+	struct list_head list;	/* in buffer or in pool free list */
+	char *data;		/* segment_size bytes, from data_alloc */
+};
+
+/* Module-wide segment pool */
+struct segment_pool {
+	spinlock_t key;
+	struct list_head free;	/* free segments, kept for reuse */
+	unsigned int nfree;	/* segments in free list */
+	unsigned int total;	/* segments allocated (free or in buffers) */
+	unsigned int max;	/* budget (in segments) */
+};
+
+/*
+ * Circular buffer, shared by many writers
+ * Writers reserve disjoint regions under a spinlock and copy into them in
+ * parallel; regions are published to readers in reservation order.
+ * Memory is a chain of segments: new segments are taken from pool when
+ * writers need space and returned as soon as they are read.
+ * Positions are free running; segment boundaries are at multiples of
+ * segment_size, first segment starts at seg_start.
+ */
 struct buffer {
-	struct kfifo fifo;
-	struct mutex lock;	/* prevent parallel access */
+	struct list_head segments; /* oldest (with cons_pos) first */
+	unsigned int seg_start;	/* position where first segment starts */
+	unsigned int seg_end;	/* position where last segment ends */
+	unsigned int size;	/* maximum data in buffer */
+	unsigned int prod_pos;	/* end of last reserved region */
+	unsigned int commit_pos; /* data before this position is readable */
+	unsigned int cons_pos;	/* data before this position is consumed */
+	struct list_head pending; /* reservations not yet published */
+	spinlock_t key;		/* for reservations and publishing */
+	struct mutex lock;	/* readers, one at a time */
+	int users;		/* open files on its devices */
+	char *lz4_data;		/* lz4 mode: last decompressed chunk */
+	unsigned int lz4_len;	/* its size */
+	unsigned int lz4_off;	/* and how much of it is read */
 	struct list_head list;
 	int id;			/* id to differentiate buffers in prints */
 };
 
+/*
+ * lz4 mode: each write is stored as one record, header and then data
+ * (LZ4 compressed, or as is when it doesn't compress: clen == len)
+ */
+#define LZ4_CHUNK	4096	/* maximum data in record */
+
+struct lz4_hdr {
+	u16 len;		/* data size */
+	u16 clen;		/* stored size */
+};
+
+/* Region of buffer reserved by a writer */
+struct reservation {
+	struct list_head list;	/* in buffer->pending */
+	struct segment *seg;	/* segment with pos */
+	unsigned int pos;
+	unsigned int len;
+	int done;		/* data copied, can be published */
+};
+
 /* Device driver */
 struct shofer_dev {
 	dev_t dev_no;		/* device number */
@@ -54,3 +119,36 @@ printk(LEVEL "[shofer] %d: " format "\n", __LINE__, ##__VA_ARGS__)
 #warning Debug not activated
 #define LOG(format, ...)
 #endif /* SHOFER_DEBUG */
+
+#endif /* SHOFER_C */
+
+#include <linux/types.h>
+
+/*
+ * Management device (/dev/shofer_mgmt): gather ioctl reads from many
+ * devices at once. For each listed device that has data, up to its
+ * budget is read into one user buffer, as a segment: header, then data.
+ * Returns number of bytes put in buffer (0 if all devices were empty).
+ */
+#define SHOFER_IOCTL_TYPE	0x8A
+#define SHOFER_IOCTL_GATHER	_IOW(SHOFER_IOCTL_TYPE, 1, struct shofer_gather)
+
+#define SHOFER_GATHER_MAX	4096	/* devices in one gather */
+
+struct shofer_gather_dev {
+	__u32 minor;	/* device i (/dev/shofer<i>) */
+	__u32 budget;	/* at most this many bytes from it */
+};
+
+struct shofer_gather {
+	__u64 devs;	/* user address of array of struct shofer_gather_dev */
+	__u32 ndevs;	/* number of devices in it */
+	__u32 size;	/* size of buf */
+	__u64 buf;	/* user address of buffer for segments */
+};
+
+/* Segment header (data follows, segments are not aligned) */
+struct shofer_gather_hdr {
+	__u16 minor;
+	__u16 len;
+};
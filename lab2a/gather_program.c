@@ -0,0 +1,71 @@
+/* gather_program.c -- read many devices with one system call
+ *
+ * Instead of poll() and a read() for each ready device, gather ioctl on
+ * /dev/shofer_mgmt reads all listed devices (that have data) into one
+ * buffer; each device's data is a segment with a small header.
+ *
+ * Build: gcc gather_program.c -o gather_program
+ * Usage: ./gather_program budget minor...
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "config.h" /* SHOFER_IOCTL_GATHER and its structures */
+
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
+			} while (0)
+
+#define BUF_SIZE	4096
+
+int main(int argc, char *argv[])
+{
+	int fd, i;
+	long n, off;
+	unsigned int budget;
+	char buf[BUF_SIZE];
+	struct shofer_gather g;
+	struct shofer_gather_dev *devs;
+	struct shofer_gather_hdr hdr;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s budget minor...\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	budget = atol(argv[1]);
+
+	g.ndevs = argc - 2;
+	devs = calloc(g.ndevs, sizeof(struct shofer_gather_dev));
+	if (devs == NULL)
+		errExit("malloc");
+	for (i = 0; i < g.ndevs; i++) {
+		devs[i].minor = atol(argv[i + 2]);
+		devs[i].budget = budget;
+	}
+	g.devs = (unsigned long) devs;
+	g.buf = (unsigned long) buf;
+	g.size = sizeof(buf);
+
+	fd = open("/dev/shofer_mgmt", O_RDONLY);
+	if (fd == -1)
+		errExit("open");
+
+	while (1) {
+		n = ioctl(fd, SHOFER_IOCTL_GATHER, &g);
+		if (n == -1)
+			errExit("ioctl");
+
+		/* walk segments: header, then data */
+		for (off = 0; off < n; off += sizeof(hdr) + hdr.len) {
+			memcpy(&hdr, buf + off, sizeof(hdr));
+			printf("shofer%u: %u bytes: %.*s\n", hdr.minor, hdr.len,
+				(int) hdr.len, buf + off + sizeof(hdr));
+		}
+		sleep(1);
+	}
+
+	return 0;
+}
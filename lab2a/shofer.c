@@ -18,54 +18,164 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
-#include <linux/kfifo.h>
+#include <linux/log2.h>
 #include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
+#include <linux/lz4.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/uio.h>
 
+#define SHOFER_C
 #include "config.h"
 
 static int buffer_size = BUFFER_SIZE;	/* Buffer size */
 static int buffer_num = BUFFER_NUM;	/* Number of buffers */
 static int driver_num = DRIVER_NUM;	/* Number of drivers */
+static int segment_size = SEGMENT_SIZE;	/* Bytes in a segment */
+static int pool_size = POOL_SIZE;	/* Memory budget for all buffers */
 
 /* Some parameters can be given at module load time */
 module_param(buffer_size, int, S_IRUGO);
-MODULE_PARM_DESC(buffer_size, "Buffer size in bytes");
+MODULE_PARM_DESC(buffer_size, "Maximum bytes in a buffer");
 module_param(buffer_num, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_num, "Number of buffers to create");
 module_param(driver_num, int, S_IRUGO);
 MODULE_PARM_DESC(driver_num, "Number of devices to create");
+module_param(segment_size, int, S_IRUGO);
+MODULE_PARM_DESC(segment_size, "Buffer memory segment size, power of 2");
+module_param(pool_size, int, S_IRUGO);
+MODULE_PARM_DESC(pool_size, "Memory (in bytes) shared by all buffers");
+
+/* Allocator for buffer data, see BACKING_* in config.h */
+static int backing = BACKING_KMALLOC;
+module_param(backing, int, S_IRUGO);
+MODULE_PARM_DESC(backing, "Buffer memory: 0 - kmalloc, 1 - vmalloc, 2 - pages");
+
+/*
+ * LZ4 mode: data is compressed on write and decompressed on read, so the
+ * same memory holds more (compressible) data; costs CPU time and
+ * needs kernel with LZ4 library (CONFIG_LZ4_COMPRESS, LZ4_DECOMPRESS)
+ */
+static bool lz4 = false;
+module_param(lz4, bool, S_IRUGO);
+MODULE_PARM_DESC(lz4, "Compress data in buffers with LZ4");
+
+static atomic64_t lz4_in;		/* bytes given by writers */
+static atomic64_t lz4_stored;		/* bytes put in buffers (with headers) */
+static atomic64_t lz4_compress_ns;	/* time spent compressing */
+static atomic64_t lz4_decompress_ns;	/* time spent decompressing */
+static DEFINE_PER_CPU(void *, lz4_wrkmem); /* LZ4 compression state */
+
+static int lz4_stats_get(char *buf, const struct kernel_param *kp)
+{
+	u64 in = atomic64_read(&lz4_in);
+	u64 stored = atomic64_read(&lz4_stored);
+	u64 ratio = stored ? div64_u64(in * 100, stored) : 0;
+
+	return sprintf(buf, "in=%llu stored=%llu ratio=%llu.%02llu "
+		"compress_ns=%llu decompress_ns=%llu\n", in, stored,
+		ratio / 100, ratio % 100, (u64) atomic64_read(&lz4_compress_ns),
+		(u64) atomic64_read(&lz4_decompress_ns));
+}
+
+static const struct kernel_param_ops lz4_stats_ops = {
+	.get = lz4_stats_get,
+};
+module_param_cb(lz4_stats, &lz4_stats_ops, NULL, S_IRUGO);
+MODULE_PARM_DESC(lz4_stats, "LZ4 mode statistics (read only)");
 
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
 static LIST_HEAD(buffers_list);
+static DEFINE_MUTEX(buffers_lock); /* buffer users */
 static LIST_HEAD(shofers_list); /* A list of devices */
+static struct shofer_dev **shofer_index; /* devices by minor (for gather) */
+static struct shofer_dev *mgmt_dev; /* management device, after others */
 
 static dev_t Dev_no = 0;
 
+static struct segment_pool pool = {
+	.key = __SPIN_LOCK_UNLOCKED(pool.key),
+	.free = LIST_HEAD_INIT(pool.free),
+};
+
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
 static void buffer_delete(struct buffer *);
+static void *data_alloc(size_t);
+static void data_free(void *, size_t);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
 static void cleanup(void);
 static void dump_buffer(char *, struct shofer_dev *, struct buffer *);
 static void simulate_delay(long delay_ms);
+static int ring_reserve(struct buffer *, struct reservation **, unsigned int,
+	unsigned int);
+static void ring_commit(struct buffer *, struct reservation *, int);
+static int ring_copy_from_iter(struct segment *, unsigned int,
+	struct iov_iter *, unsigned int);
+static unsigned int ring_copy_to_iter(struct buffer *, unsigned int,
+	struct iov_iter *, unsigned int);
+static void ring_release(struct buffer *);
+static void ring_zero(struct segment *, unsigned int, unsigned int);
+static void ring_copy_in(struct segment *, unsigned int, const void *,
+	unsigned int);
+static void ring_copy_out(struct buffer *, unsigned int, void *, unsigned int);
+static ssize_t lz4_write(struct buffer *, struct iov_iter *, size_t);
+static ssize_t lz4_read(struct buffer *, struct iov_iter *, size_t);
+static ssize_t buffer_read(struct buffer *, struct iov_iter *, size_t);
+static int buffer_readable(struct buffer *);
+static int lock_iocb(struct mutex *, struct kiocb *);
+static int lz4_init(void);
+static void lz4_cleanup(void);
+static unsigned int pool_get(struct list_head *, unsigned int);
+static void pool_put(struct list_head *, unsigned int);
+static void pool_delete(void);
+static void buffer_shrink(struct buffer *);
+static int pool_shrinker_register(void);
+static void pool_shrinker_unregister(void);
 
 static int shofer_open(struct inode *, struct file *);
-static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static int shofer_release(struct inode *, struct file *);
+static ssize_t shofer_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_write_iter(struct kiocb *, struct iov_iter *);
 static unsigned int shofer_poll(struct file *filp, poll_table *wait);
+static long mgmt_ioctl(struct file *, unsigned int, unsigned long);
+
+/*
+ * splice(2), sendfile(2): data goes between pipe (or file) and buffer
+ * through read_iter/write_iter, without a copy in user space
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define shofer_splice_read	copy_splice_read
+#else
+#define shofer_splice_read	generic_file_splice_read
+#endif
 
 static struct file_operations shofer_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open,
-	.read =     shofer_read,
-	.write =    shofer_write,
+	.release =  shofer_release,
+	.read_iter =  shofer_read_iter,
+	.write_iter = shofer_write_iter,
+	.splice_read = shofer_splice_read,
+	.splice_write = iter_file_splice_write,
 	.poll =     shofer_poll
 };
 
+static struct file_operations mgmt_fops = {
+	.owner =		THIS_MODULE,
+	.unlocked_ioctl =	mgmt_ioctl
+};
+
 /* init module */
 static int __init shofer_module_init(void)
 {
@@ -76,14 +186,44 @@ static int __init shofer_module_init(void)
 
 	klog(KERN_NOTICE, "Module started initialization");
 
-	/* get device number(s) */
-	retval = alloc_chrdev_region(&dev_no, 0, driver_num, DRIVER_NAME);
+	if (backing < BACKING_KMALLOC || backing > BACKING_PAGES) {
+		klog(KERN_WARNING, "Unknown backing %d", backing);
+		return -EINVAL;
+	}
+
+	if (driver_num < 1 || driver_num > U16_MAX) {
+		klog(KERN_WARNING, "Bad driver_num %d", driver_num);
+		return -EINVAL;
+	}
+
+	/* get device number(s), last one is for management device */
+	retval = alloc_chrdev_region(&dev_no, 0, driver_num + 1, DRIVER_NAME);
 	if (retval < 0) {
 		klog(KERN_WARNING, "Can't get major device number");
 		return retval;
 	}
 	Dev_no = dev_no; //remember first
 
+	/* Segment pool, memory for all buffers */
+	if (segment_size < 8 || pool_size < segment_size) {
+		klog(KERN_WARNING, "Bad segment_size or pool_size");
+		retval = -EINVAL;
+		goto no_driver;
+	}
+	segment_size = rounddown_pow_of_two(segment_size);
+	pool.max = pool_size / segment_size;
+
+	/* let kernel take back free segments under memory pressure */
+	retval = pool_shrinker_register();
+	if (retval)
+		goto no_driver;
+
+	if (lz4) {
+		retval = lz4_init();
+		if (retval)
+			goto no_driver;
+	}
+
 	/* Create and add buffers to the list */
 	for (i = 0; i < buffer_num; i++) {
 		buffer = buffer_create(buffer_size, &retval);
@@ -92,15 +232,27 @@ static int __init shofer_module_init(void)
 		list_add_tail(&buffer->list, &buffers_list);
 	}
 
+	shofer_index = kcalloc(driver_num, sizeof(struct shofer_dev *),
+		GFP_KERNEL);
+	if (!shofer_index) {
+		retval = -ENOMEM;
+		goto no_driver;
+	}
+
 	/* Create and add devices to the list */
 	for (i = 0; i < driver_num; i++) {
 		shofer = shofer_create(dev_no, &shofer_fops, NULL, &retval);
 		if (!shofer)
 			goto no_driver;
 		list_add_tail(&shofer->list, &shofers_list);
+		shofer_index[i] = shofer;
 		dev_no = MKDEV(MAJOR(dev_no), MINOR(dev_no) + 1);
 	}
 
+	mgmt_dev = shofer_create(dev_no, &mgmt_fops, NULL, &retval);
+	if (!mgmt_dev)
+		goto no_driver;
+
 	/* assign buffers to devices in round robin fashion */
 	buffer = list_first_entry(&buffers_list, struct buffer, list);
 	list_for_each_entry(shofer, &shofers_list, list) {
@@ -127,17 +279,25 @@ static void cleanup(void)
 	struct buffer *buffer, *b;
 	struct shofer_dev *shofer, *s;
 
+	if (mgmt_dev)
+		shofer_delete(mgmt_dev);
+	mgmt_dev = NULL;
 	list_for_each_entry_safe (shofer, s, &shofers_list, list) {
 		list_del (&shofer->list);
 		shofer_delete(shofer);
 	}
+	kfree(shofer_index);
+	shofer_index = NULL;
 	list_for_each_entry_safe (buffer, b, &buffers_list, list) {
 		list_del (&buffer->list);
 		buffer_delete(buffer);
 	}
+	pool_shrinker_unregister();
+	pool_delete();
+	lz4_cleanup();
 
 	if (Dev_no)
-		unregister_chrdev_region(Dev_no, driver_num);
+		unregister_chrdev_region(Dev_no, driver_num + 1);
 }
 
 /* called when module exit */
@@ -155,20 +315,35 @@ module_exit(shofer_module_exit);
 static struct buffer *buffer_create(size_t size, int *retval)
 {
 	static int buffer_id = 0;
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
+	struct buffer *buffer;
+
+	/* no memory for data yet, segments are added as needed */
+	buffer = kmalloc(sizeof(struct buffer), GFP_KERNEL);
 	if (!buffer) {
 		*retval = -ENOMEM;
 		klog(KERN_WARNING, "kmalloc failed");
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
-	if (*retval) {
-		kfree(buffer);
-		klog(KERN_WARNING, "kfifo_init failed");
-		return NULL;
-	}
+	INIT_LIST_HEAD(&buffer->segments);
+	buffer->seg_start = buffer->seg_end = 0;
+	buffer->size = size;
+	buffer->prod_pos = buffer->commit_pos = buffer->cons_pos = 0;
+	INIT_LIST_HEAD(&buffer->pending);
+	spin_lock_init(&buffer->key);
 	buffer->id = buffer_id++;
 	mutex_init(&buffer->lock);
+	buffer->users = 0;
+	buffer->lz4_data = NULL;
+	buffer->lz4_len = buffer->lz4_off = 0;
+	if (lz4) {
+		buffer->lz4_data = kmalloc(LZ4_CHUNK, GFP_KERNEL);
+		if (!buffer->lz4_data) {
+			kfree(buffer);
+			*retval = -ENOMEM;
+			klog(KERN_WARNING, "kmalloc failed");
+			return NULL;
+		}
+	}
 
 	*retval = 0;
 
@@ -176,6 +351,9 @@ static struct buffer *buffer_create(size_t size, int *retval)
 }
 static void buffer_delete(struct buffer *buffer)
 {
+	pool_put(&buffer->segments,
+		(buffer->seg_end - buffer->seg_start) / segment_size);
+	kfree(buffer->lz4_data);
 	kfree(buffer);
 }
 
@@ -224,31 +402,49 @@ static int shofer_open(struct inode *inode, struct file *filp)
 
 	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
 	filp->private_data = shofer; /* for other methods */
+	filp->f_mode |= FMODE_NOWAIT; /* RWF_NOWAIT: see lock_iocb */
+
+	/* no memory is taken here, segments come with first write */
+	mutex_lock(&buffers_lock);
+	shofer->buffer->users++;
+	mutex_unlock(&buffers_lock);
 
 	return 0;
 }
 
-static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
-	loff_t *f_pos)
+/* Last close returns all segments of an empty buffer to pool */
+static int shofer_release(struct inode *inode, struct file *filp)
 {
-	ssize_t retval = 0;
 	struct shofer_dev *shofer = filp->private_data;
 	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
-	unsigned int copied;
 
-	if (mutex_lock_interruptible(&buffer->lock))
-		return -ERESTARTSYS;
+	mutex_lock(&buffers_lock);
+	buffer->users--;
+	if (!buffer->users)
+		buffer_shrink(buffer);
+	mutex_unlock(&buffers_lock);
 
-	dump_buffer("read-start", shofer, buffer);
+	return 0;
+}
+
+/* read, readv, preadv2: whole iov_iter is filled under one lock */
+static ssize_t shofer_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t retval = 0;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
+	struct buffer *buffer = shofer->buffer;
+	size_t count = iov_iter_count(to);
 
-	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
+	retval = lock_iocb(&buffer->lock, iocb);
 	if (retval)
-		klog(KERN_WARNING, "kfifo_to_user failed");
-	else
-		retval = copied;
+		return retval;
+
+	dump_buffer("read-start", shofer, buffer);
+
+	retval = buffer_read(buffer, to, count);
 
-	simulate_delay(1000);
+	if (!(iocb->ki_flags & IOCB_NOWAIT))
+		simulate_delay(1000);
 
 	dump_buffer("read-end", shofer, buffer);
 
@@ -259,31 +455,46 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	return retval;
 }
 
-static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
-	size_t count, loff_t *f_pos)
+/*
+ * write, writev, pwritev2: one region is reserved for all of iov_iter
+ * (as much as fits) and filled from all of its pieces
+ */
+static ssize_t shofer_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
-	unsigned int copied;
-
-	if (mutex_lock_interruptible(&buffer->lock))
-		return -ERESTARTSYS;
+	struct reservation *resv;
+	size_t count = iov_iter_count(from);
+	int len;
 
 	dump_buffer("write-start", shofer, buffer);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
+	if (lz4) {
+		retval = lz4_write(buffer, from, count);
+		goto write_end;
+	}
+
+	/* get own region of buffer; other writers get different ones */
+	len = ring_reserve(buffer, &resv, min_t(size_t, count, buffer->size), 1);
+	if (len <= 0)
+		return len;
+
+	/* copy without any lock held, in parallel with other writers */
+	retval = ring_copy_from_iter(resv->seg, resv->pos, from, len);
 	if (retval)
-		klog(KERN_WARNING, "kfifo_from_user failed");
+		klog(KERN_WARNING, "ring_copy_from_iter failed");
 	else
-		retval = copied;
+		retval = len;
 
-	simulate_delay(1000);
+	if (!(iocb->ki_flags & IOCB_NOWAIT))
+		simulate_delay(1000);
 
-	dump_buffer("write-end", shofer, buffer);
+	/* publish (this and all completed regions before it) */
+	ring_commit(buffer, resv, retval < 0);
 
-	mutex_unlock(&buffer->lock);
+write_end:
+	dump_buffer("write-end", shofer, buffer);
 
 	wake_up_all(&shofer->wq); /* for poll */
 
@@ -294,15 +505,20 @@ static unsigned int shofer_poll(struct file *filp, poll_table *wait)
 {
 	struct shofer_dev *shofer = filp->private_data;
 	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
-	unsigned int len = kfifo_len(fifo);
-	unsigned int avail = kfifo_avail(fifo);
+	unsigned int cons_pos = smp_load_acquire(&buffer->cons_pos);
+	unsigned int prod_pos = READ_ONCE(buffer->prod_pos);
+	unsigned int avail = buffer->size - (prod_pos - cons_pos);
 	unsigned int mask = 0;
 
+	/* space left in last segment and in pool */
+	if (READ_ONCE(buffer->seg_end) == prod_pos && !READ_ONCE(pool.nfree) &&
+		READ_ONCE(pool.total) >= pool.max)
+		avail = 0;
+
 	poll_wait(filp, &shofer->rq, wait);
 	poll_wait(filp, &shofer->wq, wait);
 
-	if (len)
+	if (buffer_readable(buffer))
 		mask |= POLLIN | POLLRDNORM; /* readable */
 	if (avail)
 		mask |= POLLOUT | POLLWRNORM; /* writable */
@@ -310,16 +526,817 @@ static unsigned int shofer_poll(struct file *filp, poll_table *wait)
 	return mask;
 }
 
+/*
+ * Move up to count bytes from buffer to iov_iter
+ * Reader holds buffer->lock. Returns number of bytes moved.
+ */
+static ssize_t buffer_read(struct buffer *buffer, struct iov_iter *to,
+	size_t count)
+{
+	unsigned int pos, len, copied;
+
+	if (lz4)
+		return lz4_read(buffer, to, count);
+
+	/* only readers move cons_pos, and they hold buffer->lock */
+	pos = buffer->cons_pos;
+	len = smp_load_acquire(&buffer->commit_pos) - pos;
+	if (count < len)
+		len = count;
+
+	copied = ring_copy_to_iter(buffer, pos, to, len);
+	if (copied != len)
+		klog(KERN_WARNING, "ring_copy_to_iter failed");
+	if (!copied && len)
+		return -EFAULT;
+
+	/* what user got is consumed; release space for writers */
+	smp_store_release(&buffer->cons_pos, pos + copied);
+	ring_release(buffer);
+
+	return copied;
+}
+
+/* Is there anything to read (checked without lock) */
+static int buffer_readable(struct buffer *buffer)
+{
+	unsigned int cons_pos = smp_load_acquire(&buffer->cons_pos);
+
+	return smp_load_acquire(&buffer->commit_pos) != cons_pos ||
+		READ_ONCE(buffer->lz4_off) != READ_ONCE(buffer->lz4_len);
+}
+
+/* iov_iter over a single user buffer that is to be filled */
+static int import_user_dest(void __user *buf, size_t len, struct iovec *iov,
+	struct iov_iter *iter)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	return import_ubuf(ITER_DEST, buf, len, iter);
+#else
+	return import_single_range(READ, buf, len, iov, iter);
+#endif
+}
+
+/*
+ * Gather: read listed devices into one user buffer, with one syscall
+ * Only buffers that have data are locked, and only if no other reader
+ * holds them (gather never waits). Each read gives a segment: header
+ * with device and length, then data.
+ */
+static long mgmt_ioctl(struct file *filp, unsigned int request,
+	unsigned long arg)
+{
+	long retval = 0;
+	struct shofer_gather g;
+	struct shofer_gather_dev *devs;
+	struct shofer_gather_hdr hdr;
+	struct shofer_dev *shofer;
+	struct buffer *buffer;
+	struct iovec iov;
+	struct iov_iter iter;
+	char __user *ubuf;
+	size_t room, budget, off, total = 0;
+	ssize_t n;
+	unsigned int i;
+
+	if (request != SHOFER_IOCTL_GATHER)
+		return -ENOTTY;
+
+	if (copy_from_user(&g, (void __user *) arg, sizeof(g)))
+		return -EFAULT;
+	if (!g.ndevs || g.ndevs > SHOFER_GATHER_MAX)
+		return -EINVAL;
+
+	devs = memdup_user(u64_to_user_ptr(g.devs),
+		g.ndevs * sizeof(struct shofer_gather_dev));
+	if (IS_ERR(devs))
+		return PTR_ERR(devs);
+	for (i = 0; i < g.ndevs; i++) {
+		if (devs[i].minor >= driver_num) {
+			retval = -EINVAL;
+			goto out;
+		}
+	}
+
+	ubuf = u64_to_user_ptr(g.buf);
+	retval = import_user_dest(ubuf, g.size, &iov, &iter);
+	if (retval)
+		goto out;
+
+	for (i = 0; i < g.ndevs; i++) {
+		shofer = shofer_index[devs[i].minor];
+		buffer = shofer->buffer;
+
+		room = iov_iter_count(&iter);
+		if (room <= sizeof(hdr))
+			break;
+		budget = min_t(size_t, devs[i].budget, room - sizeof(hdr));
+		budget = min_t(size_t, budget, U16_MAX); /* fits in hdr.len */
+
+		/* empty buffers are not locked */
+		if (!budget || !buffer_readable(buffer))
+			continue;
+		if (!mutex_trylock(&buffer->lock))
+			continue;
+
+		/* data after header; header when its length is known */
+		off = g.size - room;
+		iov_iter_advance(&iter, sizeof(hdr));
+		n = buffer_read(buffer, &iter, budget);
+
+		mutex_unlock(&buffer->lock);
+
+		if (n <= 0) {
+			iov_iter_revert(&iter, sizeof(hdr));
+			if (n < 0) {
+				retval = n;
+				break;
+			}
+			continue;
+		}
+
+		hdr.minor = devs[i].minor;
+		hdr.len = n;
+		if (copy_to_user(ubuf + off, &hdr, sizeof(hdr))) {
+			retval = -EFAULT;
+			break;
+		}
+		total = off + sizeof(hdr) + n;
+
+		wake_up_all(&shofer->rq); /* for poll */
+	}
+
+	/* data taken from buffers is returned even if a later one failed */
+	if (total)
+		retval = total;
+	LOG("gather: %zu bytes from %u devices", total, g.ndevs);
+
+out:
+	kfree(devs);
+
+	return retval;
+}
+
+/*
+ * Reserve up to count (but at least min) bytes for a writer
+ * Returns reserved size (0 if buffer is full) or -ENOMEM.
+ */
+static int ring_reserve(struct buffer *buffer, struct reservation **resv,
+	unsigned int count, unsigned int min)
+{
+	struct reservation *r;
+	struct segment *seg;
+	unsigned int avail, have, need, start, nspare = 0, got = 1;
+	LIST_HEAD(spare);
+
+	/* freed by whoever publishes it, so not on writer's stack */
+	r = kmalloc(sizeof(struct reservation), GFP_KERNEL);
+	if (!r) {
+		klog(KERN_WARNING, "kmalloc failed");
+		return -ENOMEM;
+	}
+
+	/*
+	 * Extend segment chain to cover region. Missing segments are taken
+	 * from pool with buffer unlocked (they can't be allocated under
+	 * spinlock), so chain is checked again after; stop when region is
+	 * covered or pool can't give more.
+	 */
+	while (1) {
+		spin_lock(&buffer->key);
+
+		avail = buffer->size -
+			(buffer->prod_pos - smp_load_acquire(&buffer->cons_pos));
+		if (count > avail)
+			count = avail;
+
+		while (buffer->seg_end - buffer->prod_pos < count && nspare) {
+			list_move_tail(spare.next, &buffer->segments);
+			buffer->seg_end += segment_size;
+			nspare--;
+		}
+		have = buffer->seg_end - buffer->prod_pos;
+		if (count <= have || !got)
+			break;
+
+		need = DIV_ROUND_UP(count - have, segment_size);
+		spin_unlock(&buffer->key);
+
+		got = pool_get(&spare, need);
+		nspare += got;
+	}
+
+	if (count > have)
+		count = have;
+	if (count < min)
+		count = 0;
+
+	if (count) {
+		/* region starts in one of the last segments */
+		start = buffer->seg_end;
+		list_for_each_entry_reverse(seg, &buffer->segments, list) {
+			start -= segment_size;
+			if (buffer->prod_pos - start < segment_size)
+				break;
+		}
+		r->seg = seg;
+		r->pos = buffer->prod_pos;
+		r->len = count;
+		r->done = 0;
+		buffer->prod_pos += count;
+		list_add_tail(&r->list, &buffer->pending);
+	}
+
+	/* not needed after all (others extended chain), at once back to pool */
+	pool_put(&spare, nspare);
+
+	spin_unlock(&buffer->key);
+
+	if (!count)
+		kfree(r);
+	else
+		*resv = r;
+
+	return count;
+}
+
+/*
+ * Mark region as copied and publish all leading completed regions
+ * A failed copy can be taken back only if nothing was reserved after it;
+ * otherwise it is published with its uncopied part zero filled (by
+ * ring_copy_from_iter), never with old data of reused segments.
+ */
+static void ring_commit(struct buffer *buffer, struct reservation *resv,
+	int failed)
+{
+	struct reservation *r, *n;
+
+	spin_lock(&buffer->key);
+
+	if (failed && buffer->prod_pos == resv->pos + resv->len) {
+		buffer->prod_pos = resv->pos;
+		list_del(&resv->list);
+		kfree(resv);
+	}
+	else {
+		resv->done = 1;
+	}
+
+	list_for_each_entry_safe(r, n, &buffer->pending, list) {
+		if (!r->done)
+			break;
+		smp_store_release(&buffer->commit_pos, r->pos + r->len);
+		list_del(&r->list);
+		kfree(r);
+	}
+
+	spin_unlock(&buffer->key);
+}
+
+/*
+ * Copy len bytes from user space (iov_iter, possibly many pieces) into
+ * buffer, starting at position pos in segment seg (and following ones)
+ * On fault, rest of region is zeroed: segments come from pool and still
+ * hold what was in them before (maybe data of another buffer).
+ */
+static int ring_copy_from_iter(struct segment *seg, unsigned int pos,
+	struct iov_iter *from, unsigned int len)
+{
+	unsigned int off = pos & (segment_size - 1);
+	unsigned int l, copied;
+
+	while (len) {
+		l = min(len, segment_size - off);
+		copied = copy_from_iter(seg->data + off, l, from);
+		if (copied != l) {
+			ring_zero(seg, off + copied, len - copied);
+			return -EFAULT;
+		}
+		len -= l;
+		off = 0;
+		seg = list_next_entry(seg, list);
+	}
+
+	return 0;
+}
+
+/*
+ * Copy len bytes from buffer, starting at position pos, to iov_iter
+ * Returns number of bytes copied (less than len on fault).
+ */
+static unsigned int ring_copy_to_iter(struct buffer *buffer, unsigned int pos,
+	struct iov_iter *to, unsigned int len)
+{
+	/* reader holds buffer->lock; segments before pos are released */
+	struct segment *seg = list_first_entry(&buffer->segments,
+		struct segment, list);
+	unsigned int off = pos & (segment_size - 1);
+	unsigned int l, copied, done = 0;
+
+	while (done < len) {
+		l = min(len - done, segment_size - off);
+		copied = copy_to_iter(seg->data + off, l, to);
+		done += copied;
+		if (copied != l)
+			break;
+		off = 0;
+		seg = list_next_entry(seg, list);
+	}
+
+	return done;
+}
+
+/* Zero len bytes of buffer from position pos in segment seg on */
+static void ring_zero(struct segment *seg, unsigned int pos, unsigned int len)
+{
+	unsigned int off = pos & (segment_size - 1);
+	unsigned int l;
+
+	while (len) {
+		l = min(len, segment_size - off);
+		memset(seg->data + off, 0, l);
+		len -= l;
+		off = 0;
+		seg = list_next_entry(seg, list);
+	}
+}
+
+/* Copy len bytes of kernel data into buffer, like ring_copy_from_iter */
+static void ring_copy_in(struct segment *seg, unsigned int pos,
+	const void *buf, unsigned int len)
+{
+	unsigned int off = pos & (segment_size - 1);
+	unsigned int l;
+
+	while (len) {
+		l = min(len, segment_size - off);
+		memcpy(seg->data + off, buf, l);
+		buf += l;
+		len -= l;
+		off = 0;
+		seg = list_next_entry(seg, list);
+	}
+}
+
+/* Copy len bytes from buffer into kernel memory, like ring_copy_to_iter */
+static void ring_copy_out(struct buffer *buffer, unsigned int pos, void *buf,
+	unsigned int len)
+{
+	struct segment *seg = list_first_entry(&buffer->segments,
+		struct segment, list);
+	unsigned int off = pos & (segment_size - 1);
+	unsigned int l;
+
+	while (len) {
+		l = min(len, segment_size - off);
+		memcpy(buf, seg->data + off, l);
+		buf += l;
+		len -= l;
+		off = 0;
+		seg = list_next_entry(seg, list);
+	}
+}
+
+/*
+ * lz4 mode write: compress up to LZ4_CHUNK bytes into a single record
+ * Chunk is halved until its record fits in buffer (as is, if nothing
+ * else). Returns number of bytes taken from iov_iter (0 if buffer is full);
+ * whole chunk is copied first, so what isn't stored is reverted.
+ */
+static ssize_t lz4_write(struct buffer *buffer, struct iov_iter *from,
+	size_t count)
+{
+	struct lz4_hdr *hdr;
+	struct reservation *resv;
+	char *src, *rec = NULL;
+	unsigned int len = min_t(size_t, count, LZ4_CHUNK);
+	unsigned int copied = 0;
+	int stored;
+	ssize_t retval;
+	u64 t;
+
+	if (!len)
+		return 0; /* empty record would look like end of file */
+
+	src = kmalloc(len, GFP_KERNEL);
+	rec = kmalloc(sizeof(struct lz4_hdr) + LZ4_COMPRESSBOUND(len),
+		GFP_KERNEL);
+	if (!src || !rec) {
+		klog(KERN_WARNING, "kmalloc failed");
+		retval = -ENOMEM;
+		goto out;
+	}
+	copied = copy_from_iter(src, len, from);
+	if (copied != len) {
+		klog(KERN_WARNING, "copy_from_iter failed");
+		retval = -EFAULT;
+		goto out;
+	}
+
+	hdr = (struct lz4_hdr *) rec;
+	t = ktime_get_ns();
+	while (1) {
+		stored = LZ4_compress_default(src, rec + sizeof(struct lz4_hdr),
+			len, LZ4_COMPRESSBOUND(len), *get_cpu_ptr(&lz4_wrkmem));
+		put_cpu_ptr(&lz4_wrkmem);
+		if (stored <= 0 || stored >= len) { /* doesn't compress */
+			memcpy(rec + sizeof(struct lz4_hdr), src, len);
+			stored = len;
+		}
+		if (sizeof(struct lz4_hdr) + stored <= buffer->size)
+			break;
+		len /= 2; /* buffer->size > header, so len won't reach 0 */
+	}
+	atomic64_add(ktime_get_ns() - t, &lz4_compress_ns);
+	hdr->len = len;
+	hdr->clen = stored;
+
+	/* whole record or nothing */
+	retval = ring_reserve(buffer, &resv, sizeof(struct lz4_hdr) + stored,
+		sizeof(struct lz4_hdr) + stored);
+	if (retval <= 0)
+		goto out;
+	ring_copy_in(resv->seg, resv->pos, rec, retval);
+	ring_commit(buffer, resv, 0);
+
+	atomic64_add(len, &lz4_in);
+	atomic64_add(retval, &lz4_stored);
+	retval = len;
+
+out:
+	/* give back to iov_iter what wasn't stored */
+	iov_iter_revert(from, retval > 0 ? copied - retval : copied);
+	kfree(src);
+	kfree(rec);
+
+	return retval;
+}
+
+/*
+ * lz4 mode read: give data from last decompressed chunk; when it is used
+ * up, take next record from buffer and decompress it
+ * Reader holds buffer->lock; records are published whole.
+ */
+static ssize_t lz4_read(struct buffer *buffer, struct iov_iter *to,
+	size_t count)
+{
+	struct lz4_hdr hdr;
+	unsigned int pos, reclen, n;
+	char *rec;
+	int len;
+	u64 t;
+
+	if (buffer->lz4_off == buffer->lz4_len) {
+		pos = buffer->cons_pos;
+		if (smp_load_acquire(&buffer->commit_pos) == pos)
+			return 0; /* empty */
+
+		ring_copy_out(buffer, pos, &hdr, sizeof(hdr));
+		reclen = sizeof(hdr) + hdr.clen;
+		rec = kmalloc(reclen, GFP_KERNEL);
+		if (!rec) {
+			klog(KERN_WARNING, "kmalloc failed");
+			return -ENOMEM;
+		}
+		ring_copy_out(buffer, pos, rec, reclen);
+		smp_store_release(&buffer->cons_pos, pos + reclen);
+		ring_release(buffer);
+
+		t = ktime_get_ns();
+		if (hdr.clen == hdr.len) {
+			memcpy(buffer->lz4_data, rec + sizeof(hdr), hdr.len);
+			len = hdr.len;
+		}
+		else {
+			len = LZ4_decompress_safe(rec + sizeof(hdr),
+				buffer->lz4_data, hdr.clen, LZ4_CHUNK);
+		}
+		atomic64_add(ktime_get_ns() - t, &lz4_decompress_ns);
+		kfree(rec);
+
+		if (len != hdr.len) {
+			klog(KERN_WARNING, "bad LZ4 record (%d of %u bytes)",
+				len, hdr.len);
+			return -EIO;
+		}
+		buffer->lz4_len = len;
+		buffer->lz4_off = 0;
+	}
+
+	n = min_t(size_t, count, buffer->lz4_len - buffer->lz4_off);
+	if (copy_to_iter(buffer->lz4_data + buffer->lz4_off, n, to) != n)
+		return -EFAULT;
+	buffer->lz4_off += n;
+
+	return n;
+}
+
+/*
+ * Lock for read; with IOCB_NOWAIT (RWF_NOWAIT in preadv2/pwritev2) don't
+ * wait for it, caller gets EAGAIN instead (and there is no delay)
+ */
+static int lock_iocb(struct mutex *lock, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	if (mutex_lock_interruptible(lock))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+/* Compression state for each CPU */
+static int lz4_init(void)
+{
+	int cpu;
+
+	if (buffer_size <= sizeof(struct lz4_hdr)) {
+		klog(KERN_WARNING, "buffer_size too small for lz4 mode");
+		return -EINVAL;
+	}
+	for_each_possible_cpu(cpu) {
+		per_cpu(lz4_wrkmem, cpu) = kmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+		if (!per_cpu(lz4_wrkmem, cpu)) {
+			klog(KERN_WARNING, "kmalloc failed");
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void lz4_cleanup(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(lz4_wrkmem, cpu));
+		per_cpu(lz4_wrkmem, cpu) = NULL;
+	}
+
+	if (lz4)
+		klog(KERN_NOTICE, "lz4: %llu bytes stored in %llu",
+			(u64) atomic64_read(&lz4_in),
+			(u64) atomic64_read(&lz4_stored));
+}
+
+/* Return segments that are completely read to pool */
+static void ring_release(struct buffer *buffer)
+{
+	LIST_HEAD(done);
+	unsigned int n = 0;
+
+	spin_lock(&buffer->key);
+	while (buffer->cons_pos - buffer->seg_start >= segment_size &&
+		buffer->seg_start != buffer->seg_end) {
+		list_move_tail(buffer->segments.next, &done);
+		buffer->seg_start += segment_size;
+		n++;
+	}
+	spin_unlock(&buffer->key);
+
+	pool_put(&done, n);
+}
+
+/*
+ * Return all segments of buffer to pool if it is empty
+ * Called when buffer has no users, so no one holds a position in it and
+ * positions can start from zero again.
+ */
+static void buffer_shrink(struct buffer *buffer)
+{
+	LIST_HEAD(done);
+	unsigned int n;
+
+	spin_lock(&buffer->key);
+	if (buffer->cons_pos != buffer->prod_pos) {
+		spin_unlock(&buffer->key);
+		return; /* data stays for next reader */
+	}
+	n = (buffer->seg_end - buffer->seg_start) / segment_size;
+	list_splice_init(&buffer->segments, &done);
+	buffer->seg_start = buffer->seg_end = 0;
+	buffer->prod_pos = buffer->commit_pos = buffer->cons_pos = 0;
+	spin_unlock(&buffer->key);
+
+	pool_put(&done, n);
+	LOG("buffer %d idle, %u segments returned to pool", buffer->id, n);
+}
+
+/* Take up to n segments from pool (free list first); returns how many */
+static unsigned int pool_get(struct list_head *segs, unsigned int n)
+{
+	struct segment *seg;
+	unsigned int got = 0;
+
+	while (got < n) {
+		spin_lock(&pool.key);
+		if (pool.nfree) {
+			list_move_tail(pool.free.next, segs);
+			pool.nfree--;
+			spin_unlock(&pool.key);
+			got++;
+			continue;
+		}
+		if (pool.total >= pool.max) {
+			spin_unlock(&pool.key);
+			break; /* budget used up */
+		}
+		pool.total++;
+		spin_unlock(&pool.key);
+
+		seg = kmalloc(sizeof(struct segment), GFP_KERNEL);
+		if (seg) {
+			seg->data = data_alloc(segment_size);
+			if (!seg->data) {
+				kfree(seg);
+				seg = NULL;
+			}
+		}
+		if (!seg) {
+			klog(KERN_WARNING, "segment allocation failed");
+			spin_lock(&pool.key);
+			pool.total--;
+			spin_unlock(&pool.key);
+			break;
+		}
+		list_add_tail(&seg->list, segs);
+		got++;
+	}
+
+	return got;
+}
+
+/* Return n segments from list segs into pool */
+static void pool_put(struct list_head *segs, unsigned int n)
+{
+	if (!n)
+		return;
+
+	spin_lock(&pool.key);
+	list_splice_init(segs, &pool.free);
+	pool.nfree += n;
+	spin_unlock(&pool.key);
+}
+
+/* Free all pool memory, all buffers must already return their segments */
+static void pool_delete(void)
+{
+	struct segment *seg, *s;
+
+	list_for_each_entry_safe(seg, s, &pool.free, list) {
+		list_del(&seg->list);
+		data_free(seg->data, segment_size);
+		kfree(seg);
+	}
+	if (pool.total != pool.nfree)
+		klog(KERN_WARNING, "%u segments not returned to pool",
+			pool.total - pool.nfree);
+	pool.nfree = pool.total = 0;
+}
+
+/*
+ * Allocate memory for buffer data with allocator chosen by 'backing'
+ * Pages are physically contiguous; of huge page order they are mapped
+ * with huge pages in kernel linear mapping (fewer TLB misses when
+ * streaming). If they can't be found, vmalloc is used instead.
+ */
+static void *data_alloc(size_t size)
+{
+	struct page *page;
+
+	switch (backing) {
+	case BACKING_VMALLOC:
+		return vmalloc(size);
+	case BACKING_PAGES:
+		page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN,
+			get_order(size));
+		if (page)
+			return page_address(page);
+		klog(KERN_NOTICE, "alloc_pages failed, using vmalloc");
+		return vmalloc(size);
+	default:
+		return kmalloc(size, GFP_KERNEL);
+	}
+}
+
+/* Free memory from data_alloc */
+static void data_free(void *data, size_t size)
+{
+	if (!data)
+		return;
+	if (is_vmalloc_addr(data))
+		vfree(data);
+	else if (backing == BACKING_PAGES)
+		free_pages((unsigned long) data, get_order(size));
+	else
+		kfree(data);
+}
+
+/* Shrinker: free segments in pool can be given back to kernel */
+static unsigned long pool_shrink_count(struct shrinker *shrinker,
+	struct shrink_control *sc)
+{
+	return READ_ONCE(pool.nfree);
+}
+
+static unsigned long pool_shrink_scan(struct shrinker *shrinker,
+	struct shrink_control *sc)
+{
+	struct segment *seg, *s;
+	unsigned long freed = 0;
+	LIST_HEAD(victims);
+
+	spin_lock(&pool.key);
+	while (freed < sc->nr_to_scan && pool.nfree) {
+		list_move(pool.free.next, &victims);
+		pool.nfree--;
+		pool.total--; /* budget can be used again, if needed */
+		freed++;
+	}
+	spin_unlock(&pool.key);
+
+	list_for_each_entry_safe(seg, s, &victims, list) {
+		list_del(&seg->list);
+		data_free(seg->data, segment_size);
+		kfree(seg);
+	}
+	LOG("shrinker freed %lu segments", freed);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *pool_shrinker;
+
+static int pool_shrinker_register(void)
+{
+	pool_shrinker = shrinker_alloc(0, DRIVER_NAME "-pool");
+	if (!pool_shrinker) {
+		klog(KERN_WARNING, "shrinker_alloc failed");
+		return -ENOMEM;
+	}
+	pool_shrinker->count_objects = pool_shrink_count;
+	pool_shrinker->scan_objects = pool_shrink_scan;
+	shrinker_register(pool_shrinker);
+
+	return 0;
+}
+
+static void pool_shrinker_unregister(void)
+{
+	if (pool_shrinker)
+		shrinker_free(pool_shrinker);
+	pool_shrinker = NULL;
+}
+#else /* older kernels: static shrinker */
+static struct shrinker pool_shrinker = {
+	.count_objects = pool_shrink_count,
+	.scan_objects = pool_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+static int pool_shrinker_registered;
+
+static int pool_shrinker_register(void)
+{
+	int retval;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	retval = register_shrinker(&pool_shrinker, DRIVER_NAME "-pool");
+#else
+	retval = register_shrinker(&pool_shrinker);
+#endif
+	if (retval)
+		klog(KERN_WARNING, "register_shrinker failed");
+	else
+		pool_shrinker_registered = 1;
+
+	return retval;
+}
+
+static void pool_shrinker_unregister(void)
+{
+	if (pool_shrinker_registered)
+		unregister_shrinker(&pool_shrinker);
+	pool_shrinker_registered = 0;
+}
+#endif
+
+/* Without SHOFER_DEBUG nothing is printed, so buffer isn't locked either */
 static void dump_buffer(char *prefix, struct shofer_dev *shofer, struct buffer *b)
 {
-	char buf[BUFFER_SIZE];
-	size_t copied;
+#ifdef SHOFER_DEBUG
+	unsigned int len, reserved, segments;
 
-	memset(buf, 0, BUFFER_SIZE);
-	copied = kfifo_out_peek(&b->fifo, buf, BUFFER_SIZE);
+	spin_lock(&b->key);
+	len = b->commit_pos - b->cons_pos;
+	reserved = b->prod_pos - b->commit_pos;
+	segments = (b->seg_end - b->seg_start) / segment_size;
+	spin_unlock(&b->key);
 
-	LOG("%s:id=%d,buffer:id=%d:size=%u:contains=%u:buf=%s",
-	prefix, shofer->id, b->id, kfifo_size(&b->fifo), kfifo_len(&b->fifo), buf);
+	LOG("%s:id=%d,buffer:id=%d:size=%u:contains=%u:reserved=%u:segments=%u:pool=%u/%u",
+	prefix, shofer->id, b->id, b->size, len, reserved, segments,
+	pool.total - pool.nfree, pool.max);
+#endif /* SHOFER_DEBUG */
 }
 
 static void simulate_delay(long delay_ms)
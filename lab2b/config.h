@@ -22,10 +22,44 @@
 
 #define TIMER_PERIOD	5000 /* 5000 ms */
 
+/* Allocators for buffer data (backing) */
+#define BACKING_KMALLOC	0	/* small buffers */
+#define BACKING_VMALLOC	1	/* large buffers, not physically contiguous */
+#define BACKING_PAGES	2	/* physically contiguous (compound) pages */
+
+/* What a producer does when buffer is full (in_policy, out_policy) */
+#define POLICY_BLOCK	 0	/* wait for room (timer/ioctl: leave data in in_buff) */
+#define POLICY_DROP	 1	/* drop new data */
+#define POLICY_OVERWRITE 2	/* drop oldest data; out_buff holds shofer_record */
+#define POLICY_SHORT	 3	/* take what fits, writer gets short count
+				   (timer/ioctl: leave data in in_buff); default */
+
+/* Policies where nothing is lost: data that doesn't fit stays with producer */
+#define POLICY_KEEPS(policy)	\
+	((policy) == POLICY_BLOCK || (policy) == POLICY_SHORT)
+
+#define TRANSFORM_STEPS	4	/* max transforms in a chain */
+
+/* One step of transform chain, see TRANSFORM_* below */
+struct transform {
+	int op;
+	u8 a, b;		/* arguments */
+};
+
 /* Circular buffer */
 struct buffer {
 	struct kfifo fifo;
 	spinlock_t key;
+	int policy;		/* POLICY_* */
+	unsigned long lost;	/* bytes (records) dropped or overwritten */
+	unsigned int seq;	/* sequence number of next record */
+	struct wait_queue_head wait; /* writers waiting for room (block) */
+	int reduce;		/* out_buff: REDUCE_* applied by pump */
+	unsigned int window;	/* out_buff: input samples per output one */
+	struct transform steps[TRANSFORM_STEPS]; /* out_buff: applied by pump */
+	int nsteps;
+	struct eventfd_ctx *eventfd; /* out_buff: signalled when fill ... */
+	unsigned int level;	/* ... reaches level (from below) */
 };
 
 /* Device driver */
@@ -56,10 +90,59 @@ printk(LEVEL "[shofer] %d: " format "\n", __LINE__, ##__VA_ARGS__)
 /* for ioctl */
 #define SHOFER_IOCTL_TYPE	0x8A /* type, unused by https://www.kernel.org/doc/Documentation/ioctl/ioctl-number.txt */
 #define SHOFER_IOCTL_NR		1 /* serial number */
-#define SHOFER_IOCTL_COPY	1 /* command */
+#define SHOFER_IOCTL_COPY	1 /* command: move count bytes from in to out */
+#define SHOFER_IOCTL_RESIZE_IN	2 /* command: set input buffer size to count */
+#define SHOFER_IOCTL_RESIZE_OUT	3 /* command: set output buffer size to count */
+#define SHOFER_IOCTL_LOST_IN	4 /* command: return bytes lost in input buffer */
+#define SHOFER_IOCTL_LOST_OUT	5 /* command: return records lost in output buffer */
+#define SHOFER_IOCTL_REDUCE	6 /* command: set reduction to count (REDUCE_*) */
+#define SHOFER_IOCTL_WINDOW	7 /* command: set reduction window to count samples */
+#define SHOFER_IOCTL_TRANSFORM	8 /* command: add transform to chain, count is
+				     op | a << 8 | b << 16 (TRANSFORM_*) */
+#define SHOFER_IOCTL_EVENTFD	9 /* command: signal eventfd count on output
+				     level, count -1 removes it */
+#define SHOFER_IOCTL_LEVEL	10 /* command: set output level to count bytes */
+
+/*
+ * Reductions done while moving data from input to output buffer: data
+ * is a stream of samples (int), each window of samples gives one sample
+ */
+#define REDUCE_NONE	0	/* move bytes unchanged */
+#define REDUCE_DECIMATE	1	/* first sample of window */
+#define REDUCE_MIN	2
+#define REDUCE_MAX	3
+#define REDUCE_SUM	4	/* saturated to int range */
+#define REDUCE_MEAN	5
+
+/* Transforms of bytes moved from input to output buffer, in added order */
+#define TRANSFORM_CLEAR	0	/* remove all from chain */
+#define TRANSFORM_UPPER	1	/* to upper case (ASCII) */
+#define TRANSFORM_LOWER	2	/* to lower case (ASCII) */
+#define TRANSFORM_XOR	3	/* xor with a */
+#define TRANSFORM_SUBST	4	/* replace byte a with b */
 
 struct shofer_ioctl {
 	unsigned int command;
 	unsigned int count;
 };
 
+/*
+ * Element of output buffer when out_policy=2 (overwrite oldest); read
+ * returns whole records, gaps in seq are overwritten records
+ */
+struct shofer_record {
+	unsigned int seq;
+	char data;
+	char pad[3];
+};
+
+/*
+ * With crc=1 every write is one record: this header, then len bytes of
+ * data. CRC32C of data is computed on write and checked on read, which
+ * returns whole records (header included) so user can check it again.
+ */
+struct shofer_crc_hdr {
+	unsigned int len;	/* data bytes after header */
+	unsigned int crc;	/* CRC32C of data */
+};
+
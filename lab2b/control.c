@@ -2,28 +2,97 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <asm/ioctl.h>
 
 #include "config.h" /* format for third argument of ioctl */
 
+/* index is REDUCE_* */
+static const char *reductions[] = {
+	"none", "decimate", "min", "max", "sum", "mean"
+};
+
+/* index is TRANSFORM_* */
+static const char *transforms[] = {
+	"clear", "upper", "lower", "xor", "subst"
+};
+
 int main(int argc, char *argv[])
 {
-	int fd, count;
+	int fd, count, i;
 	unsigned long request, num;
 	struct shofer_ioctl cmd;
 
 	if (argc < 2) {
 		fprintf(stderr, "Usage: %s ioctl-command\n", argv[0]);
+		fprintf(stderr, "       %s in|out new-buffer-size\n", argv[0]);
+		fprintf(stderr, "       %s lost in|out\n", argv[0]);
+		fprintf(stderr, "       %s level bytes\n", argv[0]);
+		fprintf(stderr, "       %s reduce none|decimate|min|max|sum|mean\n", argv[0]);
+		fprintf(stderr, "       %s window samples\n", argv[0]);
+		fprintf(stderr, "       %s transform clear|upper|lower|xor C|subst C1 C2\n", argv[0]);
 		return -1;
 	}
 
-	num = atol(argv[1]);
-	if (num < 1 || num > 100) {
-		fprintf(stderr, "Usage: %s ioctl-command\n", argv[0]);
-		fprintf(stderr, "ioctl-command must be a number from {1,100}\n");
-		return -1;
+	if (argc > 2 && !strcmp(argv[1], "level")) {
+		/* level: eventfd is signalled when output reaches it */
+		cmd.command = SHOFER_IOCTL_LEVEL;
+		cmd.count = atol(argv[2]);
+	}
+	else if (argc > 2 && argv[1][0] == 'l') {
+		/* lost: in|out */
+		if (argv[2][0] == 'i')
+			cmd.command = SHOFER_IOCTL_LOST_IN;
+		else
+			cmd.command = SHOFER_IOCTL_LOST_OUT;
+		cmd.count = 0;
+	}
+	else if (argc > 2 && argv[1][0] == 'r') {
+		/* reduce: operation */
+		cmd.command = SHOFER_IOCTL_REDUCE;
+		for (i = 0; i < sizeof(reductions) / sizeof(reductions[0]); i++)
+			if (!strcmp(argv[2], reductions[i]))
+				break;
+		cmd.count = i; /* unknown is rejected by driver */
+	}
+	else if (argc > 2 && argv[1][0] == 't') {
+		/* transform: operation and its arguments (characters) */
+		for (i = 0; i < sizeof(transforms) / sizeof(transforms[0]); i++)
+			if (!strcmp(argv[2], transforms[i]))
+				break;
+		cmd.command = SHOFER_IOCTL_TRANSFORM;
+		cmd.count = i; /* unknown is rejected by driver */
+		if (argc > 3)
+			cmd.count |= (unsigned char) argv[3][0] << 8;
+		if (argc > 4)
+			cmd.count |= (unsigned char) argv[4][0] << 16;
+	}
+	else if (argc > 2 && argv[1][0] == 'w') {
+		/* window: samples */
+		cmd.command = SHOFER_IOCTL_WINDOW;
+		cmd.count = atol(argv[2]);
+	}
+	else if (argc > 2) {
+		/* resize: in|out size */
+		if (argv[1][0] == 'i')
+			cmd.command = SHOFER_IOCTL_RESIZE_IN;
+		else
+			cmd.command = SHOFER_IOCTL_RESIZE_OUT;
+		cmd.count = atol(argv[2]);
+	}
+	else {
+		num = atol(argv[1]);
+		if (num < 1 || num > 100) {
+			fprintf(stderr, "Usage: %s ioctl-command\n", argv[0]);
+			fprintf(stderr, "ioctl-command must be a number from {1,100}\n");
+			return -1;
+		}
+
+		/* command (COPY) and count are passed with struct_ioctl as third argument to ioctl */
+		cmd.command = SHOFER_IOCTL_COPY;
+		cmd.count = num;
 	}
 
 	fd = open("/dev/shofer_control", O_RDONLY);
@@ -35,10 +104,6 @@ int main(int argc, char *argv[])
 	/* create request */
 	request = _IOC(_IOC_WRITE, SHOFER_IOCTL_TYPE, SHOFER_IOCTL_NR, sizeof(struct shofer_ioctl));
 
-	/* command (COPY) and count are passed with struct_ioctl as third argument to ioctl */
-	cmd.command = SHOFER_IOCTL_COPY;
-	cmd.count = num;
-	
 	count = ioctl(fd, request, (unsigned long) &cmd);
 	if (count == -1) {
 		perror("ioctl error");
@@ -6,18 +6,87 @@ Licensed under GNU General Public License v2 or later.
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
+#include "config.h" /* struct shofer_record, struct shofer_crc_hdr */
+
 #define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
 			} while (0)
 
+/* CRC32C (Castagnoli), bit at a time; same as crc_tag in driver */
+static unsigned int crc32c(const char *data, unsigned int len)
+{
+	unsigned int c = ~0, i, k;
+
+	for (i = 0; i < len; i++) {
+		c ^= (unsigned char) data[i];
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+	}
+	return ~c;
+}
+
+/*
+ * "./read e [level]": register an eventfd (through shofer_control) and
+ * wait on it instead of polling; when it is signalled, output reached
+ * level, read until it is empty (next signal comes on next crossing)
+ */
+static void eventfd_loop(int fd, unsigned int level)
+{
+	int efd, ctl;
+	char buf[64];
+	ssize_t s;
+	uint64_t events;
+	struct shofer_ioctl cmd;
+	unsigned long request = _IOC(_IOC_WRITE, SHOFER_IOCTL_TYPE,
+		SHOFER_IOCTL_NR, sizeof(struct shofer_ioctl));
+
+	efd = eventfd(0, 0);
+	ctl = open("/dev/shofer_control", O_RDONLY);
+	if (efd == -1 || ctl == -1)
+		errExit("eventfd or open /dev/shofer_control");
+
+	cmd.command = SHOFER_IOCTL_LEVEL;
+	cmd.count = level;
+	if (ioctl(ctl, request, &cmd) == -1)
+		errExit("ioctl level");
+	cmd.command = SHOFER_IOCTL_EVENTFD;
+	cmd.count = efd;
+	if (ioctl(ctl, request, &cmd) == -1)
+		errExit("ioctl eventfd");
+
+	/* data could already be above level, read it first (read of
+	   empty shofer_out returns 0, it doesn't wait) */
+	while (1) {
+		while ((s = read(fd, buf, sizeof(buf))) > 0)
+			printf("    read %zd bytes: %.*s\n", s, (int) s, buf);
+		if (s == -1)
+			errExit("read");
+
+		printf("Waiting on eventfd\n");
+		if (read(efd, &events, sizeof(events)) != sizeof(events))
+			errExit("read eventfd");
+		printf("Level %u reached (%llu times)\n", level,
+			(unsigned long long) events);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int            ready;
 	char           buf[10];
   	ssize_t        s;
 	struct pollfd  pfds;
-
+	struct shofer_record recs[4];
+	unsigned int   expected = 0, lost = 0, i, n;
+	int            records = argc > 1 && argv[1][0] == 'r';
+	int            crc = argc > 1 && argv[1][0] == 'c';
+	int            samples = argc > 1 && argv[1][0] == 's';
+	int            smp[8];
+	char           rec[sizeof(struct shofer_crc_hdr) + 4096];
+	struct shofer_crc_hdr *hdr = (struct shofer_crc_hdr *) rec;
 
     pfds.fd = open("/dev/shofer_out", O_RDONLY);
     if (pfds.fd == -1)
@@ -25,6 +94,9 @@ int main(int argc, char *argv[])
 
     printf("Opened /dev/shofer_out on fd %d\n", pfds.fd);
 
+    if (argc > 1 && argv[1][0] == 'e')
+        eventfd_loop(pfds.fd, argc > 2 ? atol(argv[2]) : 1);
+
     pfds.events = POLLIN;
 
     while(1)
@@ -42,7 +114,37 @@ int main(int argc, char *argv[])
                     (pfds.revents & POLLHUP) ? "POLLHUP " : "",
                     (pfds.revents & POLLERR) ? "POLLERR " : "");
 
-            if (pfds.revents & POLLIN) {
+            if ((pfds.revents & POLLIN) && records) {
+                /* out_policy=2: records with sequence numbers */
+                s = read(pfds.fd, recs, sizeof(recs));
+                if (s == -1)
+                    errExit("read");
+                n = s / sizeof(struct shofer_record);
+                for (i = 0; i < n; i++) {
+                    if (recs[i].seq != expected)
+                        lost += recs[i].seq - expected;
+                    expected = recs[i].seq + 1;
+                    printf("    record %u: %c\n", recs[i].seq, recs[i].data);
+                }
+                printf("    lost so far: %u\n", lost);
+            } else if ((pfds.revents & POLLIN) && crc) {
+                /* crc=1: one record per read, tag is checked again here */
+                s = read(pfds.fd, rec, sizeof(rec));
+                if (s == -1)
+                    errExit("read");
+                if (s > 0)
+                    printf("    record of %u bytes, crc %08x %s: %.*s\n",
+                            hdr->len, hdr->crc,
+                            crc32c(rec + sizeof(*hdr), hdr->len) == hdr->crc ?
+                            "ok" : "BAD", (int) hdr->len, rec + sizeof(*hdr));
+            } else if ((pfds.revents & POLLIN) && samples) {
+                /* reduction set: int samples */
+                s = read(pfds.fd, smp, sizeof(smp));
+                if (s == -1)
+                    errExit("read");
+                for (i = 0; i < s / sizeof(int); i++)
+                    printf("    sample: %d\n", smp[i]);
+            } else if (pfds.revents & POLLIN) {
                 s = read(pfds.fd, buf, sizeof(buf));
                 if (s == -1)
                     errExit("read");
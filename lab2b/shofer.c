@@ -23,10 +23,42 @@
 #include <linux/timer.h>
 #include <asm/ioctl.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/crc32c.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/version.h>
+#include <linux/eventfd.h>
+#ifdef CONFIG_X86
+#include <asm/fpu/api.h>
+#include <asm/cpufeature.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+#include <asm/fpu/xstate.h> /* cpu_has_xfeatures */
+#endif
+#endif
 
 #define SHOFER_C
 #include "config.h"
 
+/* io_uring commands for drivers (.uring_cmd), from 6.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0) && defined(CONFIG_IO_URING)
+#define SHOFER_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define uring_cmd_data(ioucmd)	io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define uring_cmd_data(ioucmd)	((ioucmd)->cmd)
+#endif
+#endif
+
 /* Buffer size */
 static int buffer_size = BUFFER_SIZE;
 
@@ -34,6 +66,35 @@ static int buffer_size = BUFFER_SIZE;
 module_param(buffer_size, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_size, "Buffer size in bytes, must be a power of 2");
 
+/* Allocator for buffer data, see BACKING_* in config.h */
+static int backing = BACKING_KMALLOC;
+module_param(backing, int, S_IRUGO);
+MODULE_PARM_DESC(backing, "Buffer memory: 0 - kmalloc, 1 - vmalloc, 2 - pages");
+
+/* Overflow policies, see POLICY_* in config.h */
+static int in_policy = POLICY_SHORT;
+module_param(in_policy, int, S_IRUGO);
+MODULE_PARM_DESC(in_policy, "Input buffer full: 0 - block, 1 - drop new, 2 - overwrite oldest, 3 - short write (default)");
+static int out_policy = POLICY_SHORT;
+module_param(out_policy, int, S_IRUGO);
+MODULE_PARM_DESC(out_policy, "Output buffer full: 0/3 - leave data in input buffer (default), 1 - drop new, 2 - overwrite oldest (with sequence numbers)");
+
+/* Records with CRC32C tag, see struct shofer_crc_hdr in config.h */
+static bool crc = false;
+module_param(crc, bool, S_IRUGO);
+MODULE_PARM_DESC(crc, "Every write is a record with CRC32C, checked on read");
+static bool crc_bench = false;
+module_param(crc_bench, bool, S_IRUGO);
+MODULE_PARM_DESC(crc_bench, "Measure CRC32C cost per byte at load time");
+static unsigned long crc_errors;
+module_param(crc_errors, ulong, S_IRUGO);
+MODULE_PARM_DESC(crc_errors, "Records that failed CRC check on read (read only)");
+
+/* Transforms (SHOFER_IOCTL_TRANSFORM) with SSE2/AVX2, on x86 */
+static bool simd = true;
+module_param(simd, bool, S_IRUGO);
+MODULE_PARM_DESC(simd, "Use SSE2/AVX2 for transforms where CPU has them");
+
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
@@ -51,8 +112,31 @@ static struct shofer_timer {
 } timer;
 
 /* prototypes */
-static struct buffer *buffer_create(size_t, int *);
+static struct buffer *buffer_create(size_t, int, int *);
+static void buffer_put(struct buffer *, char);
+static unsigned int pump(struct buffer *, struct buffer *, unsigned int);
+static unsigned int pump_records(struct buffer *, struct buffer *,
+	unsigned int);
+static unsigned int pump_reduce(struct buffer *, struct buffer *,
+	unsigned int);
+static int eventfd_set(struct buffer *, unsigned int);
+static int level_set(struct buffer *, unsigned int);
+static void level_check(struct buffer *, unsigned int);
+static int reduce_set(struct buffer *, struct buffer *, unsigned int,
+	unsigned int);
+static unsigned int pump_transform(struct buffer *, struct buffer *,
+	unsigned int);
+static int transform_add(struct buffer *, unsigned int);
+static void transform_apply(struct buffer *, u8 *, unsigned int);
+static void transform_init(void);
+static u32 crc_tag(const void *, unsigned int);
+static void crc_benchmark(void);
 static void buffer_delete(struct buffer *);
+static int buffer_resize(struct buffer *, unsigned int);
+static int fifo_alloc(struct kfifo *, unsigned int);
+static void fifo_free(struct kfifo *);
+static void *data_alloc(size_t);
+static void data_free(void *, size_t);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
@@ -64,7 +148,12 @@ static int shofer_open_read(struct inode *inode, struct file *filp);
 static int shofer_open_write(struct inode *inode, struct file *filp);
 static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t crc_read(struct file *, char __user *, size_t);
+static ssize_t crc_write(struct file *, const char __user *, size_t);
 static long control_ioctl (struct file *, unsigned int, unsigned long);
+#ifdef SHOFER_URING_CMD
+static int control_uring_cmd(struct io_uring_cmd *, unsigned int);
+#endif
 
 static struct file_operations input_fops = {
 	.owner =    THIS_MODULE,
@@ -81,7 +170,10 @@ static struct file_operations output_fops = {
 static struct file_operations control_fops = {
 	.owner =		THIS_MODULE,
 	.open =			shofer_open_read,
-	.unlocked_ioctl =	control_ioctl
+	.unlocked_ioctl =	control_ioctl,
+#ifdef SHOFER_URING_CMD
+	.uring_cmd =		control_uring_cmd,
+#endif
 };
 
 /* init module */
@@ -92,6 +184,22 @@ static int __init shofer_module_init(void)
 
 	klog(KERN_NOTICE, "Module started initialization");
 
+	if (backing < BACKING_KMALLOC || backing > BACKING_PAGES) {
+		klog(KERN_WARNING, "Unknown backing %d", backing);
+		return -EINVAL;
+	}
+	if (crc && (in_policy == POLICY_OVERWRITE ||
+		out_policy == POLICY_OVERWRITE ||
+		buffer_size <= sizeof(struct shofer_crc_hdr))) {
+		klog(KERN_WARNING, "crc records can't be overwritten "
+			"or be larger than buffer");
+		return -EINVAL;
+	}
+
+	if (crc_bench)
+		crc_benchmark();
+	transform_init();
+
 	/* get device number(s) */
 	retval = alloc_chrdev_region(&dev_no, 0, 3, DRIVER_NAME);
 	if (retval < 0) {
@@ -101,10 +209,12 @@ static int __init shofer_module_init(void)
 
 	/* create a buffer */
 	/* buffer size must be a power of 2 */
-	if (!is_power_of_2(buffer_size))
+	if (!is_power_of_2(buffer_size)) {
 		buffer_size = roundup_pow_of_two(buffer_size);
-	in_buff = buffer_create(buffer_size, &retval);
-	out_buff = buffer_create(buffer_size, &retval);
+		klog(KERN_NOTICE, "buffer_size rounded up to %d", buffer_size);
+	}
+	in_buff = buffer_create(buffer_size, in_policy, &retval);
+	out_buff = buffer_create(buffer_size, out_policy, &retval);
 	if (!in_buff || !out_buff)
 		goto no_driver;
 
@@ -165,21 +275,42 @@ module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
 /* Create and initialize a single buffer */
-static struct buffer *buffer_create(size_t size, int *retval)
+static struct buffer *buffer_create(size_t size, int policy, int *retval)
 {
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
+	struct buffer *buffer;
+
+	if (policy < POLICY_BLOCK || policy > POLICY_SHORT ||
+		(policy == POLICY_OVERWRITE &&
+		size < sizeof(struct shofer_record))) {
+		*retval = -EINVAL;
+		klog(KERN_WARNING, "Bad policy %d (or size %zu for it)",
+			policy, size);
+		return NULL;
+	}
+
+	/* data is allocated separately, so it can be replaced (resize) */
+	buffer = kmalloc(sizeof(struct buffer), GFP_KERNEL);
 	if (!buffer) {
 		*retval = -ENOMEM;
 		klog(KERN_WARNING, "kmalloc failed");
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	*retval = fifo_alloc(&buffer->fifo, size);
 	if (*retval) {
 		kfree(buffer);
-		klog(KERN_WARNING, "kfifo_init failed");
+		klog(KERN_WARNING, "fifo_alloc failed");
 		return NULL;
 	}
 	spin_lock_init(&buffer->key);
+	init_waitqueue_head(&buffer->wait);
+	buffer->policy = policy;
+	buffer->lost = 0;
+	buffer->seq = 0;
+	buffer->reduce = REDUCE_NONE;
+	buffer->window = 1;
+	buffer->nsteps = 0;
+	buffer->eventfd = NULL;
+	buffer->level = 1;
 
 	*retval = 0;
 
@@ -187,9 +318,671 @@ static struct buffer *buffer_create(size_t size, int *retval)
 }
 static void buffer_delete(struct buffer *buffer)
 {
+	if (buffer->eventfd)
+		eventfd_ctx_put(buffer->eventfd);
+	fifo_free(&buffer->fifo);
 	kfree(buffer);
 }
 
+/*
+ * Replace buffer data with a new one of given size, keeping its content
+ * Everything that can sleep is done before and after the swap, so the
+ * buffer is locked only while content is moved.
+ */
+static int buffer_resize(struct buffer *buffer, unsigned int size)
+{
+	static DEFINE_MUTEX(resize_lock); /* one resize at a time */
+	struct kfifo fifo, old;
+	char *tmp;
+	unsigned int len;
+	int retval;
+
+	if (size < 2 || !is_power_of_2(size)) {
+		klog(KERN_WARNING, "new size must be a power of 2");
+		return -EINVAL;
+	}
+	if (buffer->policy == POLICY_OVERWRITE &&
+		size < sizeof(struct shofer_record)) {
+		klog(KERN_WARNING, "new size smaller than a record");
+		return -EINVAL;
+	}
+	if (crc && size <= sizeof(struct shofer_crc_hdr)) {
+		klog(KERN_WARNING, "new size too small for crc records");
+		return -EINVAL;
+	}
+
+	tmp = kvmalloc(size, GFP_KERNEL);
+	if (!tmp) {
+		klog(KERN_WARNING, "kvmalloc failed");
+		return -ENOMEM;
+	}
+	retval = fifo_alloc(&fifo, size);
+	if (retval) {
+		kvfree(tmp);
+		klog(KERN_WARNING, "fifo_alloc failed");
+		return retval;
+	}
+
+	mutex_lock(&resize_lock);
+	spin_lock(&buffer->key);
+
+	dump_buffer("resize-start", buffer);
+
+	if (kfifo_len(&buffer->fifo) > size) {
+		/* can't shrink below what is in buffer */
+		spin_unlock(&buffer->key);
+		mutex_unlock(&resize_lock);
+		fifo_free(&fifo);
+		kvfree(tmp);
+		klog(KERN_WARNING, "buffer content doesn't fit in new size");
+		return -EBUSY;
+	}
+
+	len = kfifo_out(&buffer->fifo, tmp, size);
+	kfifo_in(&fifo, tmp, len);
+	old = buffer->fifo;
+	buffer->fifo = fifo;
+
+	dump_buffer("resize-end", buffer);
+
+	spin_unlock(&buffer->key);
+	mutex_unlock(&resize_lock);
+
+	fifo_free(&old);
+	kvfree(tmp);
+
+	wake_up_interruptible(&buffer->wait); /* there might be room now */
+
+	return 0;
+}
+
+/*
+ * Put c into buffer (locked); when buffer is full, drop c or the oldest
+ * record, as buffer policy says (POLICY_KEEPS: caller checks for room)
+ */
+static void buffer_put(struct buffer *buffer, char c)
+{
+	struct kfifo *fifo = &buffer->fifo;
+	struct shofer_record rec;
+
+	if (buffer->policy != POLICY_OVERWRITE) {
+		if (!kfifo_put(fifo, c))
+			buffer->lost++;
+		return;
+	}
+
+	/* size is a power of 2 not smaller than a record: records never split */
+	if (kfifo_avail(fifo) < sizeof(rec)) {
+		fifo->kfifo.out += sizeof(rec);
+		buffer->lost++;
+	}
+	rec.seq = buffer->seq++;
+	rec.data = c;
+	memset(rec.pad, 0, sizeof(rec.pad));
+	kfifo_in(fifo, &rec, sizeof(rec));
+}
+
+/*
+ * Move up to count bytes from in_buff to out_buff (both locked)
+ * Returns number of bytes taken from in_buff.
+ */
+static unsigned int pump(struct buffer *in_buff, struct buffer *out_buff,
+	unsigned int count)
+{
+	unsigned int moved = 0;
+	char c;
+
+	if (crc)
+		return pump_records(in_buff, out_buff, count);
+	if (out_buff->reduce != REDUCE_NONE)
+		return pump_reduce(in_buff, out_buff, count);
+	if (out_buff->nsteps)
+		return pump_transform(in_buff, out_buff, count);
+
+	while (moved < count && !kfifo_is_empty(&in_buff->fifo)) {
+		if (POLICY_KEEPS(out_buff->policy) &&
+			kfifo_is_full(&out_buff->fifo))
+			break; /* rest stays in in_buff */
+		if (!kfifo_get(&in_buff->fifo, &c)) { /* should't happen! */
+			klog(KERN_WARNING, "kfifo_get failed");
+			break;
+		}
+		buffer_put(out_buff, c);
+		LOG("moved '%c' from in to out", c);
+		moved++;
+	}
+
+	if (moved)
+		wake_up_interruptible(&in_buff->wait);
+
+	return moved;
+}
+
+/*
+ * crc mode: move up to count whole records from in_buff to out_buff
+ * (both locked); tag is only checked on read, where data leaves driver
+ * Returns number of records taken from in_buff.
+ */
+static unsigned int pump_records(struct buffer *in_buff,
+	struct buffer *out_buff, unsigned int count)
+{
+	struct shofer_crc_hdr hdr;
+	unsigned int moved = 0, len, n;
+	char tmp[64];
+
+	while (moved < count && kfifo_out_peek(&in_buff->fifo, &hdr,
+		sizeof(hdr)) == sizeof(hdr)) {
+		len = sizeof(hdr) + hdr.len;
+		if (kfifo_avail(&out_buff->fifo) < len) {
+			if (POLICY_KEEPS(out_buff->policy) &&
+				len <= kfifo_size(&out_buff->fifo))
+				break; /* rest stays in in_buff */
+			in_buff->fifo.kfifo.out += len; /* drop whole record */
+			out_buff->lost++;
+		}
+		else {
+			for (; len > 0; len -= n) {
+				n = kfifo_out(&in_buff->fifo, tmp,
+					min_t(unsigned int, len, sizeof(tmp)));
+				kfifo_in(&out_buff->fifo, tmp, n);
+			}
+		}
+		LOG("moved record of %u bytes from in to out", hdr.len);
+		moved++;
+	}
+
+	if (moved)
+		wake_up_interruptible(&in_buff->wait);
+
+	return moved;
+}
+
+/*
+ * Reduce up to count windows of samples from in_buff to one sample each
+ * in out_buff (both locked); only whole windows are taken, so a window
+ * larger than in_buff is never reduced. Window is read in chunks with
+ * plain loops over them, which compiler can unroll; chunks are small,
+ * so (unlike transforms) this stays scalar, without kernel_fpu_begin
+ * cost on every call.
+ * Returns number of windows taken from in_buff.
+ */
+static unsigned int pump_reduce(struct buffer *in_buff,
+	struct buffer *out_buff, unsigned int count)
+{
+	unsigned int window = out_buff->window;
+	unsigned int moved = 0, left, n, i;
+	int tmp[16], lo, hi, res;
+	s64 sum;
+
+	while (moved < count &&
+		kfifo_len(&in_buff->fifo) >= window * sizeof(int)) {
+		if (POLICY_KEEPS(out_buff->policy) &&
+			kfifo_avail(&out_buff->fifo) < sizeof(res))
+			break; /* rest stays in in_buff */
+
+		if (out_buff->reduce == REDUCE_DECIMATE) {
+			if (kfifo_out(&in_buff->fifo, &res, sizeof(res)) !=
+				sizeof(res))
+				break; /* shouldn't happen, length checked */
+			in_buff->fifo.kfifo.out += (window - 1) * sizeof(int);
+		}
+		else {
+			lo = INT_MAX;
+			hi = INT_MIN;
+			sum = 0;
+			for (left = window; left > 0; left -= n) {
+				n = min_t(unsigned int, left, ARRAY_SIZE(tmp));
+				n = kfifo_out(&in_buff->fifo, tmp,
+					n * sizeof(int)) / sizeof(int);
+				for (i = 0; i < n; i++) {
+					lo = min(lo, tmp[i]);
+					hi = max(hi, tmp[i]);
+					sum += tmp[i];
+				}
+			}
+			switch (out_buff->reduce) {
+			case REDUCE_MIN:
+				res = lo;
+				break;
+			case REDUCE_MAX:
+				res = hi;
+				break;
+			case REDUCE_SUM:
+				res = clamp_t(s64, sum, INT_MIN, INT_MAX);
+				break;
+			default: /* REDUCE_MEAN */
+				res = div_s64(sum, window);
+				break;
+			}
+		}
+
+		if (kfifo_avail(&out_buff->fifo) < sizeof(res))
+			out_buff->lost++; /* drop */
+		else
+			kfifo_in(&out_buff->fifo, &res, sizeof(res));
+		LOG("reduced %u samples from in to %d in out", window, res);
+		moved++;
+	}
+
+	if (moved)
+		wake_up_interruptible(&in_buff->wait);
+
+	return moved;
+}
+
+/* eventfd_signal lost its count argument in 6.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define level_signal(ctx)	eventfd_signal(ctx)
+#else
+#define level_signal(ctx)	eventfd_signal(ctx, 1)
+#endif
+
+/*
+ * Register eventfd (its descriptor is fd) to be signalled when out_buff
+ * reaches its level, replacing previous one; fd -1 only removes it
+ */
+static int eventfd_set(struct buffer *buffer, unsigned int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+
+	if (fd != (unsigned int) -1) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx)) {
+			klog(KERN_WARNING, "%u is not an eventfd", fd);
+			return PTR_ERR(ctx);
+		}
+	}
+
+	/* timer and ioctl use it with buffer locked */
+	spin_lock(&buffer->key);
+	old = buffer->eventfd;
+	buffer->eventfd = ctx;
+	spin_unlock(&buffer->key);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/* Set fill level (in bytes) at which eventfd is signalled */
+static int level_set(struct buffer *buffer, unsigned int level)
+{
+	if (!level) {
+		klog(KERN_WARNING, "level must be at least 1");
+		return -EINVAL;
+	}
+
+	spin_lock(&buffer->key);
+	buffer->level = level;
+	spin_unlock(&buffer->key);
+
+	return 0;
+}
+
+/*
+ * Signal eventfd if buffer fill reached level; before is fill before
+ * data was added. Only crossing is signalled, not every addition
+ * while above level. Buffer is locked.
+ */
+static void level_check(struct buffer *buffer, unsigned int before)
+{
+	if (buffer->eventfd && before < buffer->level &&
+		kfifo_len(&buffer->fifo) >= buffer->level)
+		level_signal(buffer->eventfd);
+}
+
+/* Set reduction (SHOFER_IOCTL_REDUCE) or its window (SHOFER_IOCTL_WINDOW) */
+static int reduce_set(struct buffer *in_buff, struct buffer *out_buff,
+	unsigned int command, unsigned int value)
+{
+	int retval = 0;
+
+	spin_lock(&out_buff->key);
+	spin_lock(&in_buff->key);
+
+	if (command == SHOFER_IOCTL_REDUCE) {
+		/* output must be a plain stream of samples */
+		if (value > REDUCE_MEAN || (value != REDUCE_NONE &&
+			(crc || out_buff->policy == POLICY_OVERWRITE ||
+			out_buff->nsteps)))
+			retval = -EINVAL;
+		else
+			out_buff->reduce = value;
+	}
+	else {
+		if (value < 1 ||
+			value > kfifo_size(&in_buff->fifo) / sizeof(int))
+			retval = -EINVAL;
+		else
+			out_buff->window = value;
+	}
+
+	spin_unlock(&in_buff->key);
+	spin_unlock(&out_buff->key);
+
+	if (retval)
+		klog(KERN_WARNING, "can't set reduction %u to %u",
+			command, value);
+
+	return retval;
+}
+
+/*
+ * Move up to count bytes from in_buff to out_buff (both locked), through
+ * transform chain; bytes are taken in chunks so that SIMD can be used
+ * Returns number of bytes taken from in_buff.
+ */
+static unsigned int pump_transform(struct buffer *in_buff,
+	struct buffer *out_buff, unsigned int count)
+{
+	unsigned int moved = 0, n, i;
+	u8 tmp[256];
+
+	while (moved < count) {
+		n = min3(count - moved, kfifo_len(&in_buff->fifo),
+			(unsigned int) sizeof(tmp));
+		if (POLICY_KEEPS(out_buff->policy))
+			n = min(n, kfifo_avail(&out_buff->fifo));
+		if (!n)
+			break; /* in_buff empty or out_buff full */
+		n = kfifo_out(&in_buff->fifo, tmp, n);
+		transform_apply(out_buff, tmp, n);
+		for (i = 0; i < n; i++)
+			buffer_put(out_buff, tmp[i]);
+		LOG("moved %u transformed bytes from in to out", n);
+		moved += n;
+	}
+
+	if (moved)
+		wake_up_interruptible(&in_buff->wait);
+
+	return moved;
+}
+
+/* Add step to transform chain of out_buff or clear it (ioctl) */
+static int transform_add(struct buffer *out_buff, unsigned int value)
+{
+	struct transform t = {
+		.op = value & 0xff, .a = value >> 8, .b = value >> 16
+	};
+	int retval = 0;
+
+	spin_lock(&out_buff->key);
+
+	if (t.op == TRANSFORM_CLEAR)
+		out_buff->nsteps = 0;
+	else if (t.op > TRANSFORM_SUBST || crc ||
+		out_buff->reduce != REDUCE_NONE)
+		retval = -EINVAL; /* transforms are for plain byte streams */
+	else if (out_buff->nsteps == TRANSFORM_STEPS)
+		retval = -ENOSPC;
+	else
+		out_buff->steps[out_buff->nsteps++] = t;
+
+	spin_unlock(&out_buff->key);
+
+	if (retval)
+		klog(KERN_WARNING, "can't add transform %u", value);
+
+	return retval;
+}
+
+/* Scalar transform; for CPUs without SIMD and for what is left after it */
+static void transform_scalar(const struct transform *t, u8 *p,
+	unsigned int n)
+{
+	unsigned int i;
+
+	switch (t->op) {
+	case TRANSFORM_UPPER:
+		for (i = 0; i < n; i++)
+			if (p[i] >= 'a' && p[i] <= 'z')
+				p[i] -= 'a' - 'A';
+		break;
+	case TRANSFORM_LOWER:
+		for (i = 0; i < n; i++)
+			if (p[i] >= 'A' && p[i] <= 'Z')
+				p[i] += 'a' - 'A';
+		break;
+	case TRANSFORM_XOR:
+		for (i = 0; i < n; i++)
+			p[i] ^= t->a;
+		break;
+	case TRANSFORM_SUBST:
+		for (i = 0; i < n; i++)
+			if (p[i] == t->a)
+				p[i] = t->b;
+		break;
+	}
+}
+
+#ifdef CONFIG_X86
+/*
+ * The same transforms on vectors of W bytes, with GCC vector extensions
+ * in functions compiled for given instruction set (rest of kernel isn't)
+ * Caller must hold kernel_fpu_begin. Returns number of bytes done, the
+ * rest (less than W) is left for transform_scalar.
+ */
+#define TRANSFORM_VECTORS(v, W, p, n, i, expr)	\
+	for (; i + W <= n; i += W) {		\
+		__builtin_memcpy(&v, p + i, W);	\
+		expr;				\
+		__builtin_memcpy(p + i, &v, W);	\
+	}
+
+#define TRANSFORM_SIMD(NAME, W, TARGET)					\
+typedef u8 NAME##_v __attribute__((vector_size(W)));			\
+static unsigned int __attribute__((target(TARGET)))			\
+transform_##NAME(const struct transform *t, u8 *p, unsigned int n)	\
+{									\
+	NAME##_v v, m;							\
+	unsigned int i = 0;						\
+									\
+	switch (t->op) {						\
+	case TRANSFORM_UPPER:						\
+		TRANSFORM_VECTORS(v, W, p, n, i,			\
+			m = (NAME##_v) ((v >= 'a') & (v <= 'z'));	\
+			v -= m & ('a' - 'A'));				\
+		break;							\
+	case TRANSFORM_LOWER:						\
+		TRANSFORM_VECTORS(v, W, p, n, i,			\
+			m = (NAME##_v) ((v >= 'A') & (v <= 'Z'));	\
+			v += m & ('a' - 'A'));				\
+		break;							\
+	case TRANSFORM_XOR:						\
+		TRANSFORM_VECTORS(v, W, p, n, i, v ^= t->a);		\
+		break;							\
+	case TRANSFORM_SUBST:						\
+		TRANSFORM_VECTORS(v, W, p, n, i,			\
+			m = (NAME##_v) (v == t->a);			\
+			v = (v & ~m) | (m & t->b));			\
+		break;							\
+	}								\
+	return i;							\
+}
+
+TRANSFORM_SIMD(sse2, 16, "sse2")
+TRANSFORM_SIMD(avx2, 32, "avx2")
+
+#define simd_usable()	irq_fpu_usable()
+#define simd_begin()	kernel_fpu_begin()
+#define simd_end()	kernel_fpu_end()
+#else /* !CONFIG_X86 */
+#define simd_usable()	false
+#define simd_begin()
+#define simd_end()
+#endif /* CONFIG_X86 */
+
+/* SIMD transform chosen by transform_init, NULL: scalar only */
+static unsigned int (*transform_simd)(const struct transform *, u8 *,
+	unsigned int);
+
+static void transform_init(void)
+{
+	const char *name = "scalar";
+
+#ifdef CONFIG_X86
+	/* AVX2 also needs YMM state enabled (saved) by kernel */
+	if (simd && boot_cpu_has(X86_FEATURE_AVX2) &&
+		boot_cpu_has(X86_FEATURE_AVX) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL)) {
+		transform_simd = transform_avx2;
+		name = "avx2";
+	}
+	else if (simd && boot_cpu_has(X86_FEATURE_XMM2)) {
+		transform_simd = transform_sse2;
+		name = "sse2";
+	}
+#endif
+	klog(KERN_NOTICE, "Transforms: %s", name);
+}
+
+/*
+ * Apply transform chain of buffer to n bytes at p; SIMD registers can't
+ * be used everywhere (e.g. in some interrupts), then it is scalar only
+ */
+static void transform_apply(struct buffer *buffer, u8 *p, unsigned int n)
+{
+	bool vector = transform_simd && n >= 16 && simd_usable();
+	unsigned int i, done;
+
+	if (vector)
+		simd_begin();
+	for (i = 0; i < buffer->nsteps; i++) {
+		done = vector ? transform_simd(&buffer->steps[i], p, n) : 0;
+		transform_scalar(&buffer->steps[i], p + done, n - done);
+	}
+	if (vector)
+		simd_end();
+}
+
+/* CRC32C of record data; lib crc32c uses CPU instructions if it can */
+static u32 crc_tag(const void *data, unsigned int len)
+{
+	return ~crc32c(~0, data, len);
+}
+
+/*
+ * Print cost of crc_tag per byte, compared with plain table driven
+ * implementation (what is used when CPU has no CRC32C instructions)
+ */
+static void crc_benchmark(void)
+{
+	static const unsigned int sizes[] = { 64, 1024, 65536 };
+	const unsigned int total = 16 << 20; /* bytes per measurement */
+	unsigned int i, j, k, n;
+	u32 *table, c, sum_lib, sum_sw;
+	u8 *data;
+	u64 t_lib, t_sw;
+
+	table = kmalloc(256 * sizeof(u32), GFP_KERNEL);
+	data = vmalloc(sizes[ARRAY_SIZE(sizes) - 1]);
+	if (!table || !data) {
+		klog(KERN_WARNING, "crc_bench: no memory");
+		goto out;
+	}
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+		table[i] = c;
+	}
+	get_random_bytes(data, sizes[ARRAY_SIZE(sizes) - 1]);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		n = total / sizes[i];
+
+		sum_lib = 0;
+		t_lib = ktime_get_ns();
+		for (j = 0; j < n; j++)
+			sum_lib ^= crc_tag(data, sizes[i]);
+		t_lib = ktime_get_ns() - t_lib;
+
+		sum_sw = 0;
+		t_sw = ktime_get_ns();
+		for (j = 0; j < n; j++) {
+			for (c = ~0, k = 0; k < sizes[i]; k++)
+				c = table[(c ^ data[k]) & 0xff] ^ (c >> 8);
+			sum_sw ^= ~c;
+		}
+		t_sw = ktime_get_ns() - t_sw;
+
+		if (sum_lib != sum_sw)
+			klog(KERN_WARNING, "crc_bench: results differ");
+
+		/* in picoseconds per byte */
+		klog(KERN_NOTICE, "crc_bench: %u byte records: crc32c %llu ps/B, "
+			"table %llu ps/B", sizes[i],
+			div_u64(t_lib * 1000, (u64) n * sizes[i]),
+			div_u64(t_sw * 1000, (u64) n * sizes[i]));
+		cond_resched();
+	}
+
+out:
+	vfree(data);
+	kfree(table);
+}
+
+/* Like kfifo_alloc/kfifo_free, but with memory from data_alloc */
+static int fifo_alloc(struct kfifo *fifo, unsigned int size)
+{
+	void *data = data_alloc(size);
+	int retval;
+
+	if (!data)
+		return -ENOMEM;
+
+	retval = kfifo_init(fifo, data, size);
+	if (retval)
+		data_free(data, size);
+
+	return retval;
+}
+
+static void fifo_free(struct kfifo *fifo)
+{
+	data_free(fifo->kfifo.data, kfifo_size(fifo));
+	fifo->kfifo.data = NULL;
+}
+
+/*
+ * Allocate memory for buffer data with allocator chosen by 'backing'
+ * Pages are physically contiguous; of huge page order they are mapped
+ * with huge pages in kernel linear mapping (fewer TLB misses when
+ * streaming). If they can't be found, vmalloc is used instead.
+ */
+static void *data_alloc(size_t size)
+{
+	struct page *page;
+
+	switch (backing) {
+	case BACKING_VMALLOC:
+		return vmalloc(size);
+	case BACKING_PAGES:
+		page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN,
+			get_order(size));
+		if (page)
+			return page_address(page);
+		klog(KERN_NOTICE, "alloc_pages failed, using vmalloc");
+		return vmalloc(size);
+	default:
+		return kmalloc(size, GFP_KERNEL);
+	}
+}
+
+/* Free memory from data_alloc */
+static void data_free(void *data, size_t size)
+{
+	if (!data)
+		return;
+	if (is_vmalloc_addr(data))
+		vfree(data);
+	else if (backing == BACKING_PAGES)
+		free_pages((unsigned long) data, get_order(size));
+	else
+		kfree(data);
+}
+
 static void dump_buffer(char *prefix, struct buffer *b)
 {
 	char buf[BUFFER_SIZE];
@@ -276,6 +1069,16 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	struct kfifo *fifo = &out_buff->fifo;
 	unsigned int copied;
 
+	if (crc)
+		return crc_read(filp, ubuf, count);
+
+	if (out_buff->policy == POLICY_OVERWRITE) {
+		/* whole records only */
+		count = rounddown(count, sizeof(struct shofer_record));
+		if (!count)
+			return -EINVAL;
+	}
+
 	spin_lock(&out_buff->key);
 
 	dump_buffer("out_dev-start:out_buff:", out_buff);
@@ -302,17 +1105,53 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	struct shofer_dev *shofer = filp->private_data;
 	struct buffer *in_buff = shofer->in_buff;
 	struct kfifo *fifo = &in_buff->fifo;
-	unsigned int copied;
+	unsigned int copied, skip;
+	size_t len = count;
+
+	if (crc)
+		return crc_write(filp, ubuf, count);
 
 	spin_lock(&in_buff->key);
 
+	while (in_buff->policy == POLICY_BLOCK && kfifo_is_full(fifo)) {
+		spin_unlock(&in_buff->key);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(in_buff->wait,
+			!kfifo_is_full(fifo)))
+			return -ERESTARTSYS;
+		spin_lock(&in_buff->key);
+	}
+
 	dump_buffer("in_dev-start:in_buff:", in_buff);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
+	if (in_buff->policy == POLICY_OVERWRITE) {
+		/* only last kfifo_size bytes could stay */
+		if (len > kfifo_size(fifo)) {
+			skip = len - kfifo_size(fifo);
+			ubuf += skip;
+			len -= skip;
+			in_buff->lost += skip;
+		}
+		/* make room by dropping oldest bytes */
+		if (len > kfifo_avail(fifo)) {
+			skip = len - kfifo_avail(fifo);
+			fifo->kfifo.out += skip;
+			in_buff->lost += skip;
+		}
+	}
+
+	retval = kfifo_from_user(fifo, (char __user *) ubuf, len, &copied);
+	if (retval) {
 		klog(KERN_WARNING, "kfifo_from_user failed");
-	else
+	}
+	else if (POLICY_KEEPS(in_buff->policy)) {
 		retval = copied;
+	}
+	else {
+		in_buff->lost += len - copied; /* drop: what didn't fit */
+		retval = count; /* writer is never stalled */
+	}
 
 	dump_buffer("in_dev-end:in_buff:", in_buff);
 
@@ -321,22 +1160,142 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	return retval;
 }
 
-static long control_ioctl (struct file *filp, unsigned int request, unsigned long arg)
+/*
+ * output_dev, crc mode: return one whole record (header and data), if
+ * count is large enough for it; data is checked against its tag first
+ */
+static ssize_t crc_read(struct file *filp, char __user *ubuf, size_t count)
 {
-	ssize_t retval = 0;
+	ssize_t retval;
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *out_buff = shofer->out_buff;
+	struct kfifo *fifo = &out_buff->fifo;
+	struct shofer_crc_hdr hdr;
+	size_t size, len;
+	char *rec;
+
+	/* record can't be larger than buffer (checked again when locked) */
+	size = min_t(size_t, count, kfifo_size(fifo));
+	if (size < sizeof(hdr))
+		return -EINVAL;
+	rec = kvmalloc(size, GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+
+	spin_lock(&out_buff->key);
+
+	dump_buffer("out_dev-start:out_buff:", out_buff);
+
+	if (kfifo_out_peek(fifo, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+		retval = 0; /* empty */
+		goto unlock;
+	}
+	len = sizeof(hdr) + hdr.len;
+	if (len > size) {
+		/* buffer could have grown in between */
+		retval = len > count ? -EMSGSIZE : -EAGAIN;
+		goto unlock;
+	}
+	retval = kfifo_out(fifo, rec, len);
+
+	dump_buffer("out_dev-end:out_buff:", out_buff);
+
+unlock:
+	spin_unlock(&out_buff->key);
+
+	if (retval > 0 && crc_tag(rec + sizeof(hdr), hdr.len) != hdr.crc) {
+		klog(KERN_WARNING, "CRC mismatch in %u byte record", hdr.len);
+		spin_lock(&out_buff->key);
+		crc_errors++;
+		spin_unlock(&out_buff->key);
+		retval = -EBADMSG; /* record is discarded */
+	}
+	if (retval > 0 && copy_to_user(ubuf, rec, retval))
+		retval = -EFAULT;
+
+	kvfree(rec);
+
+	return retval;
+}
 
+/*
+ * input_dev, crc mode: a write is one record, of at most buffer size
+ * (with header); rest is not taken. Tag is computed before locking.
+ */
+static ssize_t crc_write(struct file *filp, const char __user *ubuf,
+	size_t count)
+{
+	ssize_t retval;
 	struct shofer_dev *shofer = filp->private_data;
 	struct buffer *in_buff = shofer->in_buff;
-	struct buffer *out_buff = shofer->out_buff;
-	struct kfifo *fifo_in = &in_buff->fifo;
-	struct kfifo *fifo_out = &out_buff->fifo;
-	char c;
-	int got;
+	struct kfifo *fifo = &in_buff->fifo;
+	struct shofer_crc_hdr hdr;
+	char *data;
+	size_t len;
+
+	if (count == 0)
+		return 0;
+	hdr.len = min_t(size_t, count, kfifo_size(fifo) - sizeof(hdr));
+	len = sizeof(hdr) + hdr.len;
+
+	data = kvmalloc(hdr.len, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	if (copy_from_user(data, ubuf, hdr.len)) {
+		kvfree(data);
+		return -EFAULT;
+	}
+	hdr.crc = crc_tag(data, hdr.len);
 
-	struct shofer_ioctl cmd;
+	spin_lock(&in_buff->key);
 
-	klog(KERN_NOTICE, "IN IOCTL control");
+	while (kfifo_avail(fifo) < len) {
+		if (len > kfifo_size(fifo)) {
+			retval = -EMSGSIZE; /* buffer was made smaller */
+			goto unlock;
+		}
+		if (in_buff->policy == POLICY_DROP) {
+			in_buff->lost++;
+			retval = hdr.len; /* writer is never stalled */
+			goto unlock;
+		}
+		if (in_buff->policy == POLICY_SHORT) {
+			retval = 0; /* record not taken, writer can retry */
+			goto unlock;
+		}
+		spin_unlock(&in_buff->key);
+		if (filp->f_flags & O_NONBLOCK)
+			retval = -EAGAIN;
+		else if (wait_event_interruptible(in_buff->wait,
+			kfifo_avail(fifo) >= len))
+			retval = -ERESTARTSYS;
+		else
+			retval = 0;
+		if (retval) {
+			kvfree(data);
+			return retval;
+		}
+		spin_lock(&in_buff->key);
+	}
 
+	dump_buffer("in_dev-start:in_buff:", in_buff);
+
+	kfifo_in(fifo, &hdr, sizeof(hdr));
+	kfifo_in(fifo, data, hdr.len);
+	retval = hdr.len;
+
+	dump_buffer("in_dev-end:in_buff:", in_buff);
+
+unlock:
+	spin_unlock(&in_buff->key);
+	kvfree(data);
+
+	return retval;
+}
+
+/* Is request (of ioctl or of io_uring command) for this device? */
+static int control_request(unsigned int request)
+{
 	if (_IOC_TYPE(request) != SHOFER_IOCTL_TYPE || _IOC_NR(request) != SHOFER_IOCTL_NR) {
 		klog(KERN_WARNING, "IOC type and/or nr don't match");
 		return -EINVAL;
@@ -347,18 +1306,54 @@ static long control_ioctl (struct file *filp, unsigned int request, unsigned lon
 		return -EINVAL;
 	}
 
-	retval = copy_from_user(&cmd, (const void __user *) arg, sizeof(struct shofer_ioctl));
-	if (retval) {
-		klog(KERN_WARNING, "copy_from_user failed");
+	return 0;
+}
+
+/* Execute a control command, given with ioctl or as io_uring command */
+static long control_do(struct shofer_dev *shofer, struct shofer_ioctl *cmd)
+{
+	ssize_t retval = 0;
+
+	struct buffer *in_buff = shofer->in_buff;
+	struct buffer *out_buff = shofer->out_buff;
+	struct buffer *lost_buff;
+	unsigned int len;
+
+	switch (cmd->command) {
+	case SHOFER_IOCTL_COPY:
+		break; /* below */
+	case SHOFER_IOCTL_RESIZE_IN:
+		return buffer_resize(in_buff, cmd->count);
+	case SHOFER_IOCTL_RESIZE_OUT:
+		return buffer_resize(out_buff, cmd->count);
+	case SHOFER_IOCTL_LOST_IN:
+	case SHOFER_IOCTL_LOST_OUT:
+		lost_buff = cmd->command == SHOFER_IOCTL_LOST_IN ?
+			in_buff : out_buff;
+		spin_lock(&lost_buff->key);
+		retval = min_t(unsigned long, lost_buff->lost, INT_MAX);
+		spin_unlock(&lost_buff->key);
 		return retval;
+	case SHOFER_IOCTL_REDUCE:
+	case SHOFER_IOCTL_WINDOW:
+		return reduce_set(in_buff, out_buff, cmd->command, cmd->count);
+	case SHOFER_IOCTL_TRANSFORM:
+		return transform_add(out_buff, cmd->count);
+	case SHOFER_IOCTL_EVENTFD:
+		return eventfd_set(out_buff, cmd->count);
+	case SHOFER_IOCTL_LEVEL:
+		return level_set(out_buff, cmd->count);
+	default:
+		klog(KERN_WARNING, "unknown command %u", cmd->command);
+		return -EINVAL;
 	}
 
-	if (cmd.count == 0) {
+	if (cmd->count == 0) {
 		klog(KERN_WARNING, "copy count is zero");
 		return retval;
 	}
 
-	/* copy cmd.count bytes from in_buff to out_buff */
+	/* copy cmd->count bytes from in_buff to out_buff */
 	/* todo (similar to timer) */
     /* get locks on both buffers */
 	spin_lock(&out_buff->key);
@@ -367,24 +1362,10 @@ static long control_ioctl (struct file *filp, unsigned int request, unsigned lon
 	dump_buffer("ioctl-start:in_buff", in_buff);
 	dump_buffer("ioctl-start:out_buff", out_buff);
 
-	if (kfifo_len(fifo_in) > 0 && kfifo_avail(fifo_out) > 0) {
-        while(cmd.count > 0)
-		{
-            got = kfifo_get(fifo_in, &c);
-            if (got > 0) {
-                got = kfifo_put(fifo_out, c);
-                if (got)
-                    LOG("ioctl moved '%c' from in to out", c);
-                else /* should't happen! */
-                    klog(KERN_WARNING, "kfifo_put failed");
-            }
-            else { /* should't happen! */
-                klog(KERN_WARNING, "kfifo_get failed");
-            }
-            cmd.count--;
-			klog(KERN_NOTICE, "cmd.count: %d\n", cmd.count);
-        }
-	}
+	len = kfifo_len(&out_buff->fifo);
+	retval = pump(in_buff, out_buff, cmd->count);
+	LOG("ioctl moved %zd of %u bytes", retval, cmd->count);
+	level_check(out_buff, len);
 
 	dump_buffer("ioctl-end:in_buff", in_buff);
 	dump_buffer("ioctl-end:out_buff", out_buff);
@@ -395,14 +1376,61 @@ static long control_ioctl (struct file *filp, unsigned int request, unsigned lon
 	return retval;
 }
 
+static long control_ioctl (struct file *filp, unsigned int request, unsigned long arg)
+{
+	ssize_t retval = 0;
+	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_ioctl cmd;
+
+	klog(KERN_NOTICE, "IN IOCTL control");
+
+	retval = control_request(request);
+	if (retval)
+		return retval;
+
+	retval = copy_from_user(&cmd, (const void __user *) arg, sizeof(struct shofer_ioctl));
+	if (retval) {
+		klog(KERN_WARNING, "copy_from_user failed");
+		return retval;
+	}
+
+	return control_do(shofer, &cmd);
+}
+
+#ifdef SHOFER_URING_CMD
+/*
+ * Control commands as io_uring SQEs (IORING_OP_URING_CMD): cmd_op is the
+ * same request as for ioctl, struct shofer_ioctl is in SQE command area
+ * (fits in a normal 64 byte SQE); result of command is CQE's res.
+ */
+static int control_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	int retval;
+	struct shofer_dev *shofer = ioucmd->file->private_data;
+	struct shofer_ioctl cmd;
+
+	retval = control_request(ioucmd->cmd_op);
+	if (retval)
+		return retval;
+
+	/* SQE is in memory shared with user, take command once */
+	memcpy(&cmd, uring_cmd_data(ioucmd), sizeof(struct shofer_ioctl));
+
+	/* resize allocates and may sleep, io_uring repeats it from a worker */
+	if ((issue_flags & IO_URING_F_NONBLOCK) &&
+		(cmd.command == SHOFER_IOCTL_RESIZE_IN ||
+		cmd.command == SHOFER_IOCTL_RESIZE_OUT))
+		return -EAGAIN;
+
+	return control_do(shofer, &cmd);
+}
+#endif /* SHOFER_URING_CMD */
+
 static void timer_function(struct timer_list *t)
 {
 	struct shofer_timer *timer = container_of(t, struct shofer_timer, timer);
 	struct buffer *in_buff = timer->in_buff, *out_buff = timer->out_buff;
-	struct kfifo *fifo_in = &in_buff->fifo;
-	struct kfifo *fifo_out = &out_buff->fifo;
-	char c;
-	int got;
+	unsigned int len;
 
 	/* get locks on both buffers */
 	spin_lock(&out_buff->key);
@@ -411,25 +1439,22 @@ static void timer_function(struct timer_list *t)
 	dump_buffer("timer-start:in_buff", in_buff);
 	dump_buffer("timer-start:out_buff", out_buff);
 
-	if (kfifo_len(fifo_in) > 0 && kfifo_avail(fifo_out) > 0) {
-		got = kfifo_get(fifo_in, &c);
-		if (got > 0) {
-			got = kfifo_put(fifo_out, c);
-			if (got)
-				LOG("timer moved '%c' from in to out", c);
-			else /* should't happen! */
-				klog(KERN_WARNING, "kfifo_put failed");
-		}
-		else { /* should't happen! */
-			klog(KERN_WARNING, "kfifo_get failed");
-		}
+	len = kfifo_len(&out_buff->fifo);
+
+	if (!kfifo_is_empty(&in_buff->fifo)) {
+		pump(in_buff, out_buff, 1);
 	}
 	else {
 		LOG("timer: nothing in input buffer");
-		//for test: put '#' in output buffer
-		got = kfifo_put(fifo_out, '#');
+		//for test: put '#' in output buffer (not among records, samples)
+		if (!crc && out_buff->reduce == REDUCE_NONE &&
+			(!POLICY_KEEPS(out_buff->policy) ||
+			!kfifo_is_full(&out_buff->fifo)))
+			buffer_put(out_buff, '#');
 	}
 
+	level_check(out_buff, len);
+
 	dump_buffer("timer-end:in_buff", in_buff);
 	dump_buffer("timer-end:out_buff", out_buff);
 
@@ -0,0 +1,138 @@
+/* uring.c -- send COPY commands to shofer_control through io_uring
+ *
+ * Same command as "./control count", but 'commands' of them are put in
+ * a submission queue (IORING_OP_URING_CMD) and given to kernel with a
+ * single system call; result of each is read from its completion.
+ * No liburing, system calls are used directly.
+ *
+ * Build: gcc -O2 uring.c -o uring
+ * Usage: ./uring count [commands]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <asm/ioctl.h>
+
+#include "config.h" /* struct shofer_ioctl, request */
+
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
+			} while (0)
+
+#define MAX_COMMANDS	4096
+
+int main(int argc, char *argv[])
+{
+	int fd, ring, i;
+	unsigned int commands = 1, head, tail, mask, done = 0;
+	long total = 0;
+	struct io_uring_params p;
+	struct shofer_ioctl cmd;
+	struct io_uring_sqe *sqes, *sqe;
+	struct io_uring_cqe *cqes, *cqe;
+	unsigned int *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	char *sq, *cq;
+	size_t sq_size, cq_size;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s count [commands]\n", argv[0]);
+		return -1;
+	}
+	cmd.command = SHOFER_IOCTL_COPY;
+	cmd.count = atol(argv[1]);
+	if (argc > 2)
+		commands = atol(argv[2]);
+	if (commands < 1 || commands > MAX_COMMANDS) {
+		fprintf(stderr, "commands must be from {1,%d}\n", MAX_COMMANDS);
+		return -1;
+	}
+
+	fd = open("/dev/shofer_control", O_RDONLY);
+	if (fd == -1)
+		errExit("open failed");
+
+	memset(&p, 0, sizeof(p));
+	ring = syscall(__NR_io_uring_setup, commands, &p);
+	if (ring == -1)
+		errExit("io_uring_setup");
+
+	/* map rings (one mapping for both, from 5.4) and SQE array */
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		fprintf(stderr, "kernel too old\n");
+		return -1;
+	}
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		errExit("mmap");
+	cq = sq;
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+		IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		errExit("mmap");
+
+	sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	sq_array = (unsigned int *) (sq + p.sq_off.array);
+	cq_head = (unsigned int *) (cq + p.cq_off.head);
+	cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/* fill SQEs: request as for ioctl, command in SQE */
+	tail = *sq_tail;
+	mask = *sq_mask;
+	for (i = 0; i < commands; i++, tail++) {
+		sqe = &sqes[tail & mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_URING_CMD;
+		sqe->fd = fd;
+		sqe->cmd_op = _IOC(_IOC_WRITE, SHOFER_IOCTL_TYPE,
+			SHOFER_IOCTL_NR, sizeof(struct shofer_ioctl));
+		memcpy(sqe->cmd, &cmd, sizeof(cmd));
+		sqe->user_data = i;
+		sq_array[tail & mask] = tail & mask;
+	}
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	/* submit all and wait for all in one call */
+	if (syscall(__NR_io_uring_enter, ring, commands, commands,
+		IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+		errExit("io_uring_enter");
+
+	head = *cq_head;
+	mask = *cq_mask;
+	while (done < commands) {
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(__NR_io_uring_enter, ring, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+				errExit("io_uring_enter");
+			continue;
+		}
+		cqe = &cqes[head & mask];
+		if (cqe->res < 0)
+			fprintf(stderr, "command %llu: %s\n", cqe->user_data,
+				strerror(-cqe->res));
+		else
+			total += cqe->res;
+		head++;
+		done++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	printf("%u commands moved %ld bytes\n", commands, total);
+
+	close(ring);
+	close(fd);
+
+	return 0;
+}
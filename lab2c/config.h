@@ -11,6 +11,8 @@
 
 #pragma once
 
+#ifdef SHOFER_C
+
 #define DRIVER_NAME 	"shofer"
 
 #define AUTHOR		"Leonardo Jelenkovic"
@@ -24,7 +26,10 @@ struct pipe {
 	size_t max_threads;
 	size_t thread_cnt;
 
- 	struct kfifo fifo;
+	union {
+		struct kfifo fifo;		/* byte stream */
+		struct kfifo_rec_ptr_2 msgs;	/* same memory, msg_mode */
+	};
 	struct semaphore cs_readers;	//kritični odsječak za čitače - čitaju jedan po jedan!
 	struct semaphore empty;		//ako nema ništa u cijevi čitač koji je u KO čeka
 	int reader_waiting;		//čeka li čitač?
@@ -43,6 +48,12 @@ struct shofer_dev {
 	int id;			/* id to differentiate drivers in prints */
 };
 
+/* Open file (private_data) */
+struct shofer_file {
+	struct shofer_dev *shofer;
+	int delim;		/* line mode: read up to and including delim; -1 off */
+};
+
 
 #define klog(LEVEL, format, ...)	\
 printk(LEVEL "[shofer] %d: " format "\n", __LINE__, ##__VA_ARGS__)
@@ -58,3 +69,31 @@ printk(LEVEL "[shofer] %d: " format "\n", __LINE__, ##__VA_ARGS__)
 #warning Debug not activated
 #define LOG(format, ...)
 #endif /* SHOFER_DEBUG */
+
+#endif /* SHOFER_C */
+
+#include <linux/types.h>
+
+/* for ioctl */
+#define SHOFER_IOCTL_TYPE	0x8A
+/* set line mode delimiter (0-255) for this open file, -1 turns it off */
+#define SHOFER_IOCTL_DELIM	_IOW(SHOFER_IOCTL_TYPE, 1, int)
+/* write / read many messages under one lock; return how many were moved */
+#define SHOFER_IOCTL_ENQUEUE	_IOW(SHOFER_IOCTL_TYPE, 2, struct shofer_batch)
+#define SHOFER_IOCTL_DEQUEUE	_IOWR(SHOFER_IOCTL_TYPE, 3, struct shofer_batch)
+
+#define SHOFER_BATCH_MAX	1024	/* messages in one batch */
+
+/* One message of a batch */
+struct shofer_msg {
+	__u64 buf;	/* user address of message (buffer for dequeue) */
+	__u32 len;	/* its length (for dequeue: buffer size, set to
+			   length of received message) */
+	__u32 pad;	/* must be 0 */
+};
+
+struct shofer_batch {
+	__u64 msgs;	/* user address of array of struct shofer_msg */
+	__u32 count;	/* number of messages in array */
+	__u32 pad;	/* must be 0 */
+};
@@ -6,10 +6,14 @@
 #include <fcntl.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+
+#include "config.h" /* SHOFER_IOCTL_DELIM, SHOFER_IOCTL_DEQUEUE */
 
 
 #define CIJEV	"/dev/shofer"
-#define MAXSZ	16
+#define MAXSZ	64	/* as in write.c, so any message fits */
+#define BATCH	8	/* messages per dequeue in batch mode */
 
 int fp;
 
@@ -24,8 +28,12 @@ void my_signal_handler(int sig)
 int main(int argc, char *argv[])
 {
 	char buffer[MAXSZ];
+	char buffers[BATCH][MAXSZ + 1];
+	struct shofer_msg msgs[BATCH] = {{0}}; /* pad must be 0 */
+	struct shofer_batch batch = { .msgs = (unsigned long) msgs };
 	size_t size;
 	long pid = (long) getpid();
+	int delim, i, n;
 
 	struct sigaction sa = {{0}};
     sa.sa_handler = &my_signal_handler;
@@ -44,6 +52,38 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	/* ./read batch - up to BATCH messages with one ioctl */
+	if (argc > 1 && !strcmp(argv[1], "batch")) {
+		while(1) {
+			for (i = 0; i < BATCH; i++) {
+				msgs[i].buf = (unsigned long) buffers[i];
+				msgs[i].len = MAXSZ;
+			}
+			batch.count = BATCH;
+			n = ioctl(fp, SHOFER_IOCTL_DEQUEUE, &batch);
+			if (n == -1) {
+				perror("Greska pri citanju! Greska: ");
+				break;
+			}
+			for (i = 0; i < n; i++) {
+				buffers[i][msgs[i].len] = 0;
+				printf("Citac %ld procitao (%u): %s\n", pid,
+					msgs[i].len, buffers[i]);
+			}
+			sleep(1);
+		}
+		return -1;
+	}
+
+	/* ./read l - one line per read; ./read X - up to character X */
+	if (argc > 1) {
+		delim = strcmp(argv[1], "l") ? (unsigned char) argv[1][0] : '\n';
+		if (ioctl(fp, SHOFER_IOCTL_DELIM, &delim) == -1) {
+			perror("ioctl");
+			return -1;
+		}
+	}
+
 	while(1) {
 		memset(buffer, 0, MAXSZ);
 		printf("Citac %ld poziva read\n", pid);
@@ -22,7 +22,10 @@
 #include <linux/wait.h>
 #include <linux/kfifo.h>
 #include <linux/log2.h>
+#include <linux/uaccess.h>
+#include <asm/word-at-a-time.h>
 
+#define SHOFER_C
 #include "config.h"
 
 static int pipe_size = PIPE_SIZE;
@@ -33,6 +36,15 @@ MODULE_PARM_DESC(pipe_size, "Pipe size");
 module_param(max_threads, int, S_IRUGO);
 MODULE_PARM_DESC(max_threads, "Maximal number of threads simultaneously using message queue");
 
+/*
+ * Message mode: every write is stored as one length-prefixed message and
+ * every read returns exactly one whole message (or EMSGSIZE when given
+ * buffer is too small for it; message then stays in pipe)
+ */
+static bool msg_mode = false;
+module_param(msg_mode, bool, S_IRUGO);
+MODULE_PARM_DESC(msg_mode, "Keep message boundaries (one message per read)");
+
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
@@ -52,6 +64,11 @@ static int shofer_open(struct inode *, struct file *);
 static int shofer_release(struct inode *inode, struct file *filp);
 static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static long shofer_ioctl(struct file *, unsigned int, unsigned long);
+static long batch_enqueue(struct file *, struct shofer_msg *, unsigned int);
+static long batch_dequeue(struct file *, struct shofer_msg *, unsigned int);
+static size_t find_delim(const char *, size_t, int);
+static unsigned int line_len(struct kfifo *, int, size_t);
 int pipe_init(struct pipe *pipe, size_t pipe_size, size_t max_threads);
 static void pipe_delete(struct pipe *pipe);
 
@@ -60,6 +77,7 @@ static struct file_operations shofer_fops = {
 	.open =     shofer_open,
 	.read =     shofer_read,
 	.write =    shofer_write,
+	.unlocked_ioctl = shofer_ioctl,
 	.release = 	shofer_release
 };
 
@@ -165,14 +183,21 @@ static void shofer_delete(struct shofer_dev *shofer)
 static int shofer_open(struct inode *inode, struct file *filp)
 {
 	struct shofer_dev *shofer;
+	struct shofer_file *file;
     shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
 
 	if (shofer->pipe.thread_cnt >= shofer->pipe.max_threads)
 		return -EBUSY;
 
+	file = kmalloc(sizeof(struct shofer_file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+	file->shofer = shofer;
+	file->delim = -1;
+
 	shofer->pipe.thread_cnt++;
 
-	filp->private_data = shofer;
+	filp->private_data = file;
 
 	return 0;
 }
@@ -240,7 +265,10 @@ static void pipe_delete(struct pipe *pipe)
 /* Called when a process performs "close" operation */
 static int shofer_release(struct inode *inode, struct file *filp)
 {
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_file *file = filp->private_data;
+	struct shofer_dev *shofer = file->shofer;
+
+	kfree(file);
 	shofer->pipe.thread_cnt--;
 
 	if(shofer->pipe.thread_cnt <= 0)
@@ -254,16 +282,20 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
  	loff_t *f_pos /* ignoring f_pos */)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_file *file = filp->private_data;
+	struct shofer_dev *shofer = file->shofer;
 	struct pipe *pipe = &shofer->pipe;
 	struct kfifo *fifo = &pipe->fifo;
-	unsigned int copied;
+	unsigned int copied, len;
+	int delim = READ_ONCE(file->delim);
  
 	if (!( (filp->f_flags & O_ACCMODE) == O_RDONLY))
 	{
 		LOG("Wrong mode on pipe. File flags: %lx", filp->f_flags);  // Debugging output
 		return -EPERM;
 	}
+	if (!count)
+		return 0; /* nothing could be returned, don't wait */
 
 	if (down_interruptible(&pipe->cs_readers))
 		return -ERESTARTSYS; //čekanje prekinuto signalom
@@ -275,7 +307,12 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 			up(&pipe->cs_readers); //pusti idućeg čitača
 			return -ERESTARTSYS;
 		}
-		if (kfifo_is_empty(fifo)) {
+		/* in line mode wait for whole line (or full pipe) */
+		if (delim >= 0)
+			len = line_len(fifo, delim, count);
+		else
+			len = min_t(size_t, kfifo_len(fifo), count);
+		if (!len) {
 			pipe->reader_waiting = 1;
 			mutex_unlock(&pipe->lock); //privremeno izađi iz KO za cijev
 			if (down_interruptible(&pipe->empty)) { //čekaj da se nešto stavi
@@ -288,8 +325,17 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 
 	dump_buffer("read-start", shofer, pipe);
 
-	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
+	if (!msg_mode)
+		retval = kfifo_to_user(fifo, (char __user *) ubuf, len, &copied);
+	else if (kfifo_peek_len(&pipe->msgs) > count)
+		retval = -EMSGSIZE; /* would truncate (and lose) the rest */
+	else
+		retval = kfifo_to_user(&pipe->msgs, (char __user *) ubuf, count,
+			&copied);
+	if (retval == -EMSGSIZE)
+		LOG("Message of %u bytes doesn't fit in %zu",
+			kfifo_peek_len(&pipe->msgs), count);
+	else if (retval)
 		klog(KERN_WARNING, "kfifo_to_user failed");
 	else
 		retval = copied;
@@ -317,7 +363,8 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
  	size_t count, loff_t *f_pos /* ignoring f_pos */)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_file *file = filp->private_data;
+	struct shofer_dev *shofer = file->shofer;
 	struct pipe *pipe = &shofer->pipe;
 	struct kfifo *fifo = &pipe->fifo;
 	unsigned int copied;
@@ -330,6 +377,10 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 
 	if (count > pipe->pipe_size)
 		return -EFBIG;
+	if (msg_mode && count > kfifo_size(fifo) - kfifo_recsize(&pipe->msgs))
+		return -EMSGSIZE; /* with its header it would never fit */
+	if (msg_mode && !count)
+		return 0; /* empty message would look like end of file */
 
 	if (down_interruptible(&pipe->cs_writers))
  		return -ERESTARTSYS;
@@ -341,7 +392,8 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 			up(&pipe->cs_writers); //pusti idućeg pisača
 			return -ERESTARTSYS;
 		}
-		if (kfifo_avail(fifo) < count) {
+		if ((msg_mode ? kfifo_avail(&pipe->msgs) : kfifo_avail(fifo))
+			< count) {
 			pipe->writter_waiting = 1;
 			mutex_unlock(&pipe->lock); //privremeno izađi iz KO za cijev
 			if (down_interruptible(&pipe->full)) { //čekaj da se nešto uzme
@@ -354,7 +406,12 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 
 	dump_buffer("write-start", shofer, pipe);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
+	if (msg_mode) /* header with length, then data */
+		retval = kfifo_from_user(&pipe->msgs, (char __user *) ubuf, count,
+			&copied);
+	else
+		retval = kfifo_from_user(fifo, (char __user *) ubuf, count,
+			&copied);
 	if (retval)
 		klog(KERN_WARNING, "kfifo_from_user failed");
 	else
@@ -377,4 +434,312 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	up(&pipe->cs_writers);
  
  	return retval;
-}
\ No newline at end of file
+}
+
+static long shofer_ioctl(struct file *filp, unsigned int request,
+	unsigned long arg)
+{
+	struct shofer_file *file = filp->private_data;
+	int delim;
+	struct shofer_batch batch;
+	struct shofer_msg *msgs;
+	struct shofer_msg __user *umsgs;
+	long retval;
+	unsigned int i;
+
+	switch (request) {
+	case SHOFER_IOCTL_DELIM:
+		if (get_user(delim, (int __user *) arg))
+			return -EFAULT;
+		if (delim < -1 || delim > 255 || msg_mode) {
+			klog(KERN_WARNING, "Can't use delimiter %d", delim);
+			return -EINVAL;
+		}
+		WRITE_ONCE(file->delim, delim);
+		LOG("Line mode delimiter set to %d", delim);
+		return 0;
+	case SHOFER_IOCTL_ENQUEUE:
+	case SHOFER_IOCTL_DEQUEUE:
+		if (copy_from_user(&batch, (void __user *) arg, sizeof(batch)))
+			return -EFAULT;
+		if (!batch.count || batch.count > SHOFER_BATCH_MAX || batch.pad)
+			return -EINVAL;
+		umsgs = u64_to_user_ptr(batch.msgs);
+		msgs = memdup_user(umsgs, batch.count * sizeof(struct shofer_msg));
+		if (IS_ERR(msgs))
+			return PTR_ERR(msgs);
+		/* pad fields are reserved for later use */
+		for (i = 0; i < batch.count; i++) {
+			if (msgs[i].pad) {
+				kfree(msgs);
+				return -EINVAL;
+			}
+		}
+		if (request == SHOFER_IOCTL_ENQUEUE) {
+			retval = batch_enqueue(filp, msgs, batch.count);
+		}
+		else {
+			retval = batch_dequeue(filp, msgs, batch.count);
+			/* lengths of received messages */
+			if (retval > 0 && copy_to_user(umsgs, msgs,
+				retval * sizeof(struct shofer_msg)))
+				retval = -EFAULT;
+		}
+		kfree(msgs);
+		return retval;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Write messages from batch, in a single critical section (as one write,
+ * with its delays): waits until first message fits, then puts in all
+ * that fit. Returns number of messages written.
+ */
+static long batch_enqueue(struct file *filp, struct shofer_msg *msgs,
+	unsigned int n)
+{
+	long retval = 0;
+	struct shofer_file *file = filp->private_data;
+	struct shofer_dev *shofer = file->shofer;
+	struct pipe *pipe = &shofer->pipe;
+	struct kfifo *fifo = &pipe->fifo;
+	unsigned int copied, i, avail;
+	int ret;
+
+	if (!((filp->f_flags & O_ACCMODE) == O_WRONLY))
+		return -EPERM;
+
+	/* same checks as in shofer_write, for every message */
+	for (i = 0; i < n; i++) {
+		if (msgs[i].len > pipe->pipe_size)
+			return -EFBIG;
+		if (msg_mode && msgs[i].len > kfifo_size(fifo) -
+			kfifo_recsize(&pipe->msgs))
+			return -EMSGSIZE;
+		if (msg_mode && !msgs[i].len)
+			return -EINVAL;
+	}
+
+	if (down_interruptible(&pipe->cs_writers))
+		return -ERESTARTSYS;
+
+	//uđi u KO (za cijev)
+	while(1) {
+		if (mutex_lock_interruptible(&pipe->lock)) {
+			up(&pipe->cs_writers);
+			return -ERESTARTSYS;
+		}
+		if ((msg_mode ? kfifo_avail(&pipe->msgs) : kfifo_avail(fifo))
+			< msgs[0].len) {
+			pipe->writter_waiting = 1;
+			mutex_unlock(&pipe->lock);
+			if (down_interruptible(&pipe->full)) {
+				up(&pipe->cs_writers);
+				return -ERESTARTSYS;
+			}
+		}
+		else break;
+	}
+
+	dump_buffer("enqueue-start", shofer, pipe);
+
+	for (i = 0; i < n; i++) {
+		avail = msg_mode ? kfifo_avail(&pipe->msgs) : kfifo_avail(fifo);
+		if (avail < msgs[i].len)
+			break;
+		if (msg_mode)
+			ret = kfifo_from_user(&pipe->msgs,
+				u64_to_user_ptr(msgs[i].buf), msgs[i].len, &copied);
+		else
+			ret = kfifo_from_user(fifo,
+				u64_to_user_ptr(msgs[i].buf), msgs[i].len, &copied);
+		if (ret) {
+			klog(KERN_WARNING, "kfifo_from_user failed");
+			if (!i)
+				retval = ret;
+			break;
+		}
+	}
+	if (!retval)
+		retval = i;
+	LOG("Enqueued %ld of %u messages\n", retval, n);
+
+	simulate_delay(1000);
+
+	simulate_delay(1000);
+
+	dump_buffer("enqueue-end", shofer, pipe);
+
+	pipe->writter_waiting = 0;
+
+	if (pipe->reader_waiting)
+		up(&pipe->empty);
+
+	mutex_unlock(&pipe->lock);
+
+	up(&pipe->cs_writers);
+
+	return retval;
+}
+
+/*
+ * Read up to n messages into buffers of batch, in a single critical
+ * section: waits until there is something to read, then takes messages
+ * (in line mode lines, otherwise what fits in each buffer) until pipe
+ * is empty. Lengths are set in msgs. Returns number of messages read.
+ */
+static long batch_dequeue(struct file *filp, struct shofer_msg *msgs,
+	unsigned int n)
+{
+	long retval = 0;
+	struct shofer_file *file = filp->private_data;
+	struct shofer_dev *shofer = file->shofer;
+	struct pipe *pipe = &shofer->pipe;
+	struct kfifo *fifo = &pipe->fifo;
+	unsigned int copied, len, i;
+	int delim = READ_ONCE(file->delim);
+	int ret;
+
+	if (!((filp->f_flags & O_ACCMODE) == O_RDONLY))
+		return -EPERM;
+
+	for (i = 0; i < n; i++)
+		if (!msgs[i].len)
+			return -EINVAL; /* nothing could be returned in it */
+
+	if (down_interruptible(&pipe->cs_readers))
+		return -ERESTARTSYS;
+
+	//uđi u KO (za cijev)
+	while(1) {
+		if (mutex_lock_interruptible(&pipe->lock)) {
+			up(&pipe->cs_readers);
+			return -ERESTARTSYS;
+		}
+		if (delim >= 0)
+			len = line_len(fifo, delim, msgs[0].len);
+		else
+			len = kfifo_len(fifo);
+		if (!len) {
+			pipe->reader_waiting = 1;
+			mutex_unlock(&pipe->lock);
+			if (down_interruptible(&pipe->empty)) {
+				up(&pipe->cs_readers);
+				return -ERESTARTSYS;
+			}
+		}
+		else break;
+	}
+
+	dump_buffer("dequeue-start", shofer, pipe);
+
+	for (i = 0; i < n; i++) {
+		if (msg_mode) {
+			if (kfifo_is_empty(&pipe->msgs))
+				break;
+			if (kfifo_peek_len(&pipe->msgs) > msgs[i].len) {
+				if (!i)
+					retval = -EMSGSIZE;
+				break;
+			}
+			ret = kfifo_to_user(&pipe->msgs,
+				u64_to_user_ptr(msgs[i].buf), msgs[i].len, &copied);
+		}
+		else {
+			if (delim >= 0)
+				len = line_len(fifo, delim, msgs[i].len);
+			else
+				len = min_t(size_t, kfifo_len(fifo), msgs[i].len);
+			if (!len)
+				break;
+			ret = kfifo_to_user(fifo, u64_to_user_ptr(msgs[i].buf),
+				len, &copied);
+		}
+		if (ret) {
+			klog(KERN_WARNING, "kfifo_to_user failed");
+			if (!i)
+				retval = ret;
+			break;
+		}
+		msgs[i].len = copied;
+	}
+	if (!retval)
+		retval = i;
+	LOG("Dequeued %ld of %u messages\n", retval, n);
+
+	simulate_delay(1000);
+
+	simulate_delay(1000);
+
+	dump_buffer("dequeue-end", shofer, pipe);
+
+	pipe->reader_waiting = 0;
+
+	if (pipe->writter_waiting)
+		up(&pipe->full);
+
+	mutex_unlock(&pipe->lock);
+
+	up(&pipe->cs_readers);
+
+	return retval;
+}
+
+/*
+ * Line mode: how much to read - up to and including delimiter, at most
+ * count; if there is no delimiter, count or whole pipe when it is full
+ * (line won't fit). 0 when reader should wait. Pipe is locked.
+ * Data in kfifo is in at most two parts: from out to end of buffer and
+ * from its start; each is searched with find_delim.
+ */
+static unsigned int line_len(struct kfifo *fifo, int delim, size_t count)
+{
+	unsigned int len = kfifo_len(fifo);
+	unsigned int off = fifo->kfifo.out & fifo->kfifo.mask;
+	unsigned int l1 = min(len, kfifo_size(fifo) - off);
+	unsigned int i;
+	char *data = fifo->kfifo.data;
+
+	i = find_delim(data + off, l1, delim);
+	if (i == l1 && l1 < len)
+		i = l1 + find_delim(data, len - l1, delim);
+	if (i < len)
+		return min_t(size_t, i + 1, count);
+	if (kfifo_is_full(fifo) || len >= count)
+		return min_t(size_t, len, count);
+
+	return 0;
+}
+
+/*
+ * Index of first byte c in p[0..n), n if there is none
+ * Aligned words are checked at a time: a word contains c when word
+ * xor c (repeated in every byte) has a zero byte.
+ */
+static size_t find_delim(const char *p, size_t n, int c)
+{
+	const struct word_at_a_time constants = WORD_AT_A_TIME_CONSTANTS;
+	unsigned long pattern = REPEAT_BYTE((u8) c), word, bits;
+	size_t i = 0;
+
+	for (; i < n && !IS_ALIGNED((unsigned long) (p + i), sizeof(long)); i++)
+		if ((u8) p[i] == c)
+			return i;
+
+	for (; i + sizeof(long) <= n; i += sizeof(long)) {
+		word = *(const unsigned long *) (p + i) ^ pattern;
+		if (has_zero(word, &bits, &constants)) {
+			bits = prep_zero_mask(word, bits, &constants);
+			bits = create_zero_mask(bits);
+			return i + find_zero(bits);
+		}
+	}
+
+	for (; i < n; i++)
+		if ((u8) p[i] == c)
+			return i;
+
+	return n;
+}
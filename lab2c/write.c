@@ -6,10 +6,13 @@
 #include <fcntl.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/ioctl.h>
 
+#include "config.h" /* SHOFER_IOCTL_ENQUEUE */
 
 #define RED	"/dev/shofer"
 #define MAXSZ	64
+#define BATCH	8	/* messages per enqueue in batch mode */
 
 int fp;
 
@@ -37,8 +40,12 @@ void gen_text(char *text, size_t size)
 int main(int argc, char *argv[])
 {
 	char buffer[MAXSZ];
+	char buffers[BATCH][MAXSZ];
+	struct shofer_msg msgs[BATCH] = {{0}}; /* pad must be 0 */
+	struct shofer_batch batch = { .msgs = (unsigned long) msgs };
 	size_t size;
 	long pid = (long) getpid();
+	int i, n;
 
 	struct sigaction sa = {{0}};
     sa.sa_handler = &my_signal_handler;
@@ -58,6 +65,24 @@ int main(int argc, char *argv[])
 	}
 
 	srandom(pid);
+
+	/* ./write batch - BATCH shorter messages with one ioctl */
+	while(argc > 1 && !strcmp(argv[1], "batch")) {
+		for (i = 0; i < BATCH; i++) {
+			msgs[i].buf = (unsigned long) buffers[i];
+			msgs[i].len = 1 + random() % (MAXSZ / BATCH);
+			gen_text(buffers[i], msgs[i].len);
+		}
+		batch.count = BATCH;
+		n = ioctl(fp, SHOFER_IOCTL_ENQUEUE, &batch);
+		if (n == -1) {
+			perror("Greska pri pisanju! Greska: ");
+			return -1;
+		}
+		printf("Pisac %ld poslao %d od %d poruka\n", pid, n, BATCH);
+		sleep(2);
+	}
+
 	while(1) {
 		memset(buffer, 0, MAXSZ);
 		size = MAXSZ / 3 + random() % (2 * MAXSZ / 3);